@@ -0,0 +1,310 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "chunk.h"
+#include "intern.h"
+#include "memory.h"
+#include "scanner.h"
+#include "tokens.h"
+#include "vm.h"
+
+// Each pass is timed on its own and the fastest is reported. Passes are
+// repeated at least BENCH_RUNS times and for at least BENCH_SECONDS.
+#define BENCH_RUNS 10
+#define BENCH_SECONDS 1.0
+
+static double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint64_t mix(uint64_t hash, uint64_t value) {
+    return (hash ^ value) * 0x100000001b3ull;
+}
+
+// Folds in what the compiler sees of a token: its type, where it is and
+// its line. An error token's characters are its message.
+static uint64_t hash_token(uint64_t hash, Token token, const char* source) {
+    hash = mix(hash, token.type);
+    hash = mix(hash, (uint64_t)token.length);
+    hash = mix(hash, (uint64_t)token.line);
+    if (token.type != TOKEN_ERROR) hash = mix(hash, (uint64_t)(token.start - source));
+    return hash;
+}
+
+typedef struct {
+    int tokens;
+    uint64_t checksum;
+} LexResult;
+
+static LexResult scan_all(ObjSource* source) {
+    LexResult result = {0, 0xcbf29ce484222325ull};
+    init_scanner(source->chars);
+    for (;;) {
+        Token token = scan_token();
+        result.checksum = hash_token(result.checksum, token, source->chars);
+        result.tokens++;
+        if (token.type == TOKEN_EOF) return result;
+    }
+}
+
+// Scans on the pretokenizer's threads, timing just that, then reads the
+// tokens back for the checksum. False if the source isn't pretokenized.
+static bool pretokenize_all(ObjSource* source, double* elapsed, LexResult* result) {
+    TokenStream stream;
+    double start = seconds_now();
+    if (!pretokenize(&stream, source->chars, source->length)) return false;
+    *elapsed = seconds_now() - start;
+
+    result->tokens = 0;
+    result->checksum = 0xcbf29ce484222325ull;
+    for (;;) {
+        Token token = read_token(&stream);
+        result->checksum = hash_token(result->checksum, token, source->chars);
+        result->tokens++;
+        if (token.type == TOKEN_EOF) break;
+    }
+    free_token_stream(&stream);
+    return true;
+}
+
+static void report(const char* name, int runs, double best, int length) {
+    printf("%-12s best of %4d: %9.3f ms %10.1f MB/s\n", name, runs,
+           best * 1e3, length / best / 1e6);
+}
+
+void bench_lexer(ObjSource* source) {
+#ifdef SIMD_SSE2
+    const char* kernels = "sse2";
+#else
+    const char* kernels = "byte-wise";
+#endif /* ifdef SIMD_SSE2 */
+
+    LexResult result = {0, 0};
+    double best = 0;
+    double began = seconds_now();
+    int runs = 0;
+    while (runs < BENCH_RUNS || seconds_now() - began < BENCH_SECONDS) {
+        double start = seconds_now();
+        result = scan_all(source);
+        double elapsed = seconds_now() - start;
+        if (runs++ == 0 || elapsed < best) best = elapsed;
+    }
+
+    printf("%d bytes, %d tokens, checksum %016llx, %s scanner\n", source->length,
+           result.tokens, (unsigned long long)result.checksum, kernels);
+    report("scan_token", runs, best, source->length);
+
+    LexResult pretokenized;
+    double elapsed;
+    if (!pretokenize_all(source, &elapsed, &pretokenized)) {
+        printf("pretokenize  not used for this source on this machine\n");
+        return;
+    }
+    best = elapsed;
+    began = seconds_now();
+    runs = 1;
+    while (runs < BENCH_RUNS || seconds_now() - began < BENCH_SECONDS) {
+        pretokenize_all(source, &elapsed, &pretokenized);
+        if (elapsed < best) best = elapsed;
+        runs++;
+    }
+    report("pretokenize", runs, best, source->length);
+    if (pretokenized.tokens != result.tokens || pretokenized.checksum != result.checksum) {
+        printf("pretokenize  produced different tokens: %d, checksum %016llx\n",
+               pretokenized.tokens, (unsigned long long)pretokenized.checksum);
+    }
+}
+
+typedef struct {
+    int count;
+    int capacity;
+    // Not heap objects: they point into the source and are never collected.
+    ObjString* strings;
+    int length;
+} KeyArray;
+
+static void add_key(KeyArray* keys, const char* chars, int length) {
+    if (keys->capacity < keys->count + 1) {
+        int capacity = GROW_CAPACITY(keys->capacity);
+        keys->strings = GROW_ARRAY(MEM_SCRATCH, ObjString, keys->strings,
+                                   keys->capacity, capacity);
+        keys->capacity = capacity;
+    }
+    ObjString* string = &keys->strings[keys->count++];
+    memset(string, 0, sizeof(ObjString));
+    string->length = length;
+    string->chars = (char*)chars;
+    keys->length += length;
+}
+
+// The strings a script would hash: its identifiers and the contents of its
+// string literals.
+static void collect_keys(ObjSource* source, KeyArray* keys) {
+    init_scanner(source->chars);
+    for (;;) {
+        Token token = scan_token();
+        if (token.type == TOKEN_EOF) return;
+        if (token.type == TOKEN_IDENTIFIER) {
+            add_key(keys, token.start, token.length);
+        } else if (token.type == TOKEN_STRING) {
+            add_key(keys, token.start + 1, token.length - 2);
+        }
+    }
+}
+
+static int compare_hashes(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Interns every distinct key in a set of its own and reports how far each
+// one ended up from its home slot, and how many share a full 32-bit hash.
+static void report_intern_set(KeyArray* keys) {
+    InternSet set;
+    init_intern_set(&set);
+    for (int i = 0; i < keys->count; i++) {
+        ObjString* key = &keys->strings[i];
+        uint32_t hash = string_hash(key);
+        if (intern_find(&set, key->chars, key->length, hash) == NULL) {
+            intern_add(&set, key);
+        }
+    }
+
+    uint32_t mask = set.capacity - 1;
+    uint32_t* hashes = ALLOCATE(MEM_SCRATCH, uint32_t, set.count);
+    int stored = 0;
+    int displaced = 0;
+    long long total_probe = 0;
+    uint32_t max_probe = 0;
+    for (int i = 0; i < set.capacity; i++) {
+        // 0 and 1 mark empty and deleted slots.
+        if (set.hashes[i] <= 1) continue;
+        uint32_t probe = ((uint32_t)i - set.hashes[i]) & mask;
+        if (probe > 0) displaced++;
+        total_probe += probe;
+        if (probe > max_probe) max_probe = probe;
+        hashes[stored++] = set.hashes[i];
+    }
+
+    qsort(hashes, stored, sizeof(uint32_t), compare_hashes);
+    int collisions = 0;
+    for (int i = 1; i < stored; i++) {
+        if (hashes[i] == hashes[i - 1]) collisions++;
+    }
+
+    printf("intern set   %d distinct in %d slots: %.1f%% displaced, "
+           "mean probe %.3f, max probe %u, %d full-hash collisions\n",
+           set.count, set.capacity, stored == 0 ? 0.0 : 100.0 * displaced / stored,
+           stored == 0 ? 0.0 : (double)total_probe / stored, max_probe, collisions);
+
+    FREE_ARRAY(MEM_SCRATCH, uint32_t, hashes, set.count);
+    free_intern_set(&set);
+}
+
+void bench_hash(ObjSource* source) {
+#ifdef WORD_HASH
+    const char* kind = "word-at-a-time";
+#else
+    const char* kind = "FNV-1a";
+#endif /* ifdef WORD_HASH */
+
+    KeyArray keys = {0, 0, NULL, 0};
+    collect_keys(source, &keys);
+
+    uint32_t checksum = 0;
+    double best = 0;
+    double began = seconds_now();
+    int runs = 0;
+    while (runs < BENCH_RUNS || seconds_now() - began < BENCH_SECONDS) {
+        double start = seconds_now();
+        checksum = 0;
+        for (int i = 0; i < keys.count; i++) {
+            keys.strings[i].hash = 0;
+            checksum ^= string_hash(&keys.strings[i]);
+        }
+        double elapsed = seconds_now() - start;
+        if (runs++ == 0 || elapsed < best) best = elapsed;
+    }
+
+    printf("%d keys, %d bytes, %s hash %08x\n", keys.count, keys.length, kind, checksum);
+    report("string_hash", runs, best, keys.length);
+    report_intern_set(&keys);
+
+    FREE_ARRAY(MEM_SCRATCH, ObjString, keys.strings, keys.capacity);
+}
+
+// The rope bench appends ROPE_PIECES copies of a ROPE_MIN_LENGTH string,
+// about 1 MB in all.
+#define ROPE_PIECES 16384
+
+// One OP_CONSTANT and then an OP_ADD_CONST per further piece, as in
+// `"..." + "..." + ...`. Comparing the result with the piece flattens it.
+static void build_rope_chunk(Chunk* chunk, ObjString* piece) {
+    int constant = add_constant(chunk, OBJ_VAL(piece));
+    write_chunk(chunk, OP_CONSTANT, 1);
+    write_chunk(chunk, (uint8_t)constant, 1);
+    for (int i = 1; i < ROPE_PIECES; i++) {
+        write_chunk(chunk, OP_ADD_CONST, 1);
+        write_chunk(chunk, (uint8_t)constant, 1);
+    }
+    write_chunk(chunk, OP_CONSTANT, 1);
+    write_chunk(chunk, (uint8_t)constant, 1);
+    write_chunk(chunk, OP_EQUAL, 1);
+    write_chunk(chunk, OP_RETURN, 1);
+    compute_stack_size(chunk);
+}
+
+void bench_rope() {
+    char chars[ROPE_MIN_LENGTH];
+    for (int i = 0; i < ROPE_MIN_LENGTH; i++) chars[i] = (char)('a' + i % 26);
+    ObjString* piece = intern_string(copy_string(chars, ROPE_MIN_LENGTH));
+    // Nothing else refers to `piece` until the chunk is run.
+    push_root(OBJ_VAL(piece));
+
+    Chunk chunk;
+    init_chunk(&chunk);
+    build_rope_chunk(&chunk, piece);
+
+    // The first run also measures how far the heap grows above what is
+    // live beforehand.
+    bool enabled = memory_stats.enabled;
+    memory_stats.enabled = true;
+    collect_garbage();
+    size_t base = memory_stats.bytes_allocated;
+    memory_stats.peak_bytes = base;
+
+    double best = 0;
+    double began = seconds_now();
+    int runs = 0;
+    size_t peak = 0;
+    while (runs < BENCH_RUNS || seconds_now() - began < BENCH_SECONDS) {
+        double start = seconds_now();
+        if (run_built_chunk(&chunk) != INTERPRET_OK) break;
+        double elapsed = seconds_now() - start;
+        if (runs++ == 0) {
+            best = elapsed;
+            peak = memory_stats.peak_bytes - base;
+        } else if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    memory_stats.enabled = enabled;
+
+    int length = ROPE_PIECES * ROPE_MIN_LENGTH;
+    printf("%d appends of %d bytes, %d bytes in all, %d bytes of code\n",
+           ROPE_PIECES - 1, ROPE_MIN_LENGTH, length, chunk.count);
+    report("OP_ADD_CONST", runs, best, length);
+    printf("peak heap    %zu bytes above the %zu live before the first run\n", peak, base);
+
+    free_chunk(&chunk);
+    pop_root();
+}
@@ -0,0 +1,18 @@
+#ifndef clox_bench_h
+#define clox_bench_h
+
+#include "common.h"
+#include "object.h"
+
+// Times lexing `source` and prints the throughput, with a checksum of the
+// tokens so that builds which lex differently can be checked against
+// each other.
+void bench_lexer(ObjSource* source);
+// Times string_hash() over the identifiers and string literals in `source`
+// and reports how evenly they spread through an intern set.
+void bench_hash(ObjSource* source);
+// Times a hand-built chunk that builds a string of about 1 MB with
+// OP_ADD_CONST, and reports how much the heap grows doing so.
+void bench_rope();
+
+#endif // !clox_bench_h
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Measures string hashing with the word-at-a-time hash and with FNV-1a
+# (-DNO_WORD_HASH), and how evenly each spreads keys through an intern set.
+# Both builds must find the same keys and the same number of distinct ones.
+#
+#   bench/hash.sh [script.lox]   (CC and CFLAGS are honoured)
+#
+# Without a script, one is generated whose identifiers share long prefixes
+# and differ only in their last few characters, with string literals from
+# a couple of bytes up to well past 16.
+
+set -e
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+$CC $CFLAGS -o "$work/clox-word" *.c -lpthread
+$CC $CFLAGS -DNO_WORD_HASH -o "$work/clox-fnv" *.c -lpthread
+
+corpus=$1
+if [ -z "$corpus" ]; then
+    corpus=$work/corpus.lox
+    awk 'BEGIN {
+        for (i = 1; i <= 50000; i++) {
+            print "print configuration_value_" i " + x" i " + \"k" i "\";";
+            print "print \"a longer string literal, number " i ", to hash in blocks\";";
+        }
+    }' > "$corpus"
+fi
+
+word=$("$work/clox-word" --hash-bench "$corpus")
+fnv=$("$work/clox-fnv" --hash-bench "$corpus")
+echo "$word"
+echo "$fnv"
+
+# The first line holds the key count and size, then the hash's name and
+# checksum; the last line starts with the number of distinct keys.
+if [ "$(echo "$word" | head -1 | sed 's/, [^,]*$//')" != \
+     "$(echo "$fnv" | head -1 | sed 's/, [^,]*$//')" ] ||
+   [ "$(echo "$word" | tail -1 | sed 's/:.*//')" != \
+     "$(echo "$fnv" | tail -1 | sed 's/:.*//')" ]; then
+    echo "FAIL: the builds found different keys"
+    exit 1
+fi
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Measures lexing throughput with the SSE2 scanner and with the byte-wise
+# one (-DNO_SIMD), and checks that both produce the same tokens. Sources of
+# PRETOKENIZE_MIN_SIZE or more are also timed on the pretokenizer's threads.
+#
+#   bench/lex.sh [script.lox]   (CC and CFLAGS are honoured)
+#
+# Without a script, a few MB are generated with the long comments, strings,
+# identifiers and indentation the block scanners are for, mixed with
+# short-token code.
+
+set -e
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+$CC $CFLAGS -o "$work/clox-sse2" *.c -lpthread
+$CC $CFLAGS -DNO_SIMD -o "$work/clox-bytewise" *.c -lpthread
+
+corpus=$1
+if [ -z "$corpus" ]; then
+    corpus=$work/corpus.lox
+    awk 'BEGIN {
+        for (i = 1; i <= 40000; i++) {
+            print "        // Step " i ": a comment long enough to be worth skipping in blocks.";
+            print "        print \"line " i " has a string literal that runs on for a while\";";
+            print "        print some_rather_long_identifier_name_" i " + another_long_one;";
+            print "    print (" i " + 2) * 3 - 4 / 5 == 6;";
+            print "";
+        }
+    }' > "$corpus"
+fi
+
+sse2=$("$work/clox-sse2" --lex-bench "$corpus")
+bytewise=$("$work/clox-bytewise" --lex-bench "$corpus")
+echo "$sse2"
+echo "$bytewise"
+
+# The first line holds the token count and checksum.
+if [ "$(echo "$sse2" | head -1 | sed 's/,[^,]*$//')" != \
+     "$(echo "$bytewise" | head -1 | sed 's/,[^,]*$//')" ]; then
+    echo "FAIL: the scanners produced different tokens"
+    exit 1
+fi
+if echo "$sse2$bytewise" | grep -q "different tokens"; then
+    echo "FAIL: pretokenize produced different tokens"
+    exit 1
+fi
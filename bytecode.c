@@ -0,0 +1,471 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+#ifdef MMAP_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /* ifdef MMAP_SOURCE */
+
+#ifdef BYTECODE_CACHE
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /* ifdef BYTECODE_CACHE */
+
+#define BYTECODE_MAGIC "LOXC"
+// Bump whenever the layout or the opcode numbering changes.
+#define BYTECODE_VERSION 2
+// Reads back differently on a machine of the other endianness.
+#define BYTECODE_BYTE_ORDER 0x01020304u
+
+BytecodeCache bytecode_cache;
+
+// The start of a .loxc file. Then come the code, the line table as an
+// array of LineStart, the constants as BytecodeConstants and the string
+// section, each starting on an 8-byte boundary. The string section is
+// followed by SOURCE_PADDING zero bytes so it can stand in for the source.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t compiler_version;
+    uint32_t byte_order;
+    uint32_t code_count;
+    uint32_t line_count;
+    uint32_t constant_count;
+    uint32_t strings_length;
+    uint32_t source_length;
+    uint64_t source_hash;
+} BytecodeHeader;
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+} ConstantTag;
+
+typedef struct {
+    uint32_t tag;
+    // A string's length in bytes.
+    uint32_t length;
+    // A number's bits, or where a string starts in the string section.
+    uint64_t payload;
+} BytecodeConstant;
+
+// Where each section of a file starts.
+typedef struct {
+    size_t code;
+    size_t lines;
+    size_t constants;
+    size_t strings;
+    size_t end;
+} Layout;
+
+static size_t align8(size_t offset) {
+    return (offset + 7) & ~(size_t)7;
+}
+
+static void lay_out(const BytecodeHeader* header, Layout* layout) {
+    layout->code = sizeof(BytecodeHeader);
+    layout->lines = align8(layout->code + header->code_count);
+    layout->constants = layout->lines + sizeof(LineStart) * (size_t)header->line_count;
+    layout->strings = layout->constants + sizeof(BytecodeConstant) * (size_t)header->constant_count;
+    layout->end = layout->strings + header->strings_length + SOURCE_PADDING;
+}
+
+// FNV-1a over eight bytes at a time. The source's zero padding makes the
+// last, partial word safe to read.
+SourceKey source_key(ObjSource* source) {
+    uint64_t hash = 14695981039346656037ull ^ (uint64_t)source->length;
+    for (int i = 0; i < source->length; i += 8) {
+        uint64_t word;
+        memcpy(&word, source->chars + i, sizeof(word));
+        if (source->length - i < 8) word &= ~(uint64_t)0 >> (64 - 8 * (source->length - i));
+        hash ^= word;
+        hash *= 1099511628211ull;
+        hash ^= hash >> 32;
+    }
+
+    SourceKey key;
+    key.hash = hash;
+    key.length = source->length;
+    return key;
+}
+
+static bool write_zeros(FILE* file, size_t count) {
+    static const char zeros[16] = {0};
+    while (count > 0) {
+        size_t chunk = count < sizeof(zeros) ? count : sizeof(zeros);
+        if (fwrite(zeros, 1, chunk, file) != chunk) return false;
+        count -= chunk;
+    }
+    return true;
+}
+
+static bool write_sections(Chunk* chunk, const BytecodeHeader* header, FILE* file) {
+    Layout layout;
+    lay_out(header, &layout);
+
+    if (fwrite(header, sizeof(BytecodeHeader), 1, file) != 1) return false;
+    if (fwrite(chunk->code, 1, chunk->count, file) != (size_t)chunk->count) return false;
+    if (!write_zeros(file, layout.lines - layout.code - chunk->count)) return false;
+    if (fwrite(chunk->lines, sizeof(LineStart), chunk->line_count, file) !=
+        (size_t)chunk->line_count) {
+        return false;
+    }
+
+    uint64_t offset = 0;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        BytecodeConstant constant;
+        memset(&constant, 0, sizeof(BytecodeConstant));
+        if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            constant.tag = CONSTANT_NUMBER;
+            memcpy(&constant.payload, &number, sizeof(number));
+        } else {
+            constant.tag = CONSTANT_STRING;
+            constant.length = (uint32_t)AS_STRING(value)->length;
+            constant.payload = offset;
+            offset += constant.length;
+        }
+        if (fwrite(&constant, sizeof(BytecodeConstant), 1, file) != 1) return false;
+    }
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (!IS_STRING(value)) continue;
+        ObjString* string = AS_STRING(value);
+        if (fwrite(string->chars, 1, string->length, file) != (size_t)string->length) {
+            return false;
+        }
+    }
+    return write_zeros(file, SOURCE_PADDING);
+}
+
+// Writes to a temporary file first and renames it into place, so a reader
+// never maps a half-written chunk.
+bool write_bytecode(Chunk* chunk, SourceKey key, const char* path) {
+    BytecodeHeader header;
+    memset(&header, 0, sizeof(BytecodeHeader));
+    memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+    header.version = BYTECODE_VERSION;
+    header.compiler_version = COMPILER_VERSION;
+    header.byte_order = BYTECODE_BYTE_ORDER;
+    header.code_count = (uint32_t)chunk->count;
+    header.line_count = (uint32_t)chunk->line_count;
+    header.constant_count = (uint32_t)chunk->constants.count;
+    header.source_length = (uint32_t)key.length;
+    header.source_hash = key.hash;
+
+    // Only numbers and flat strings are ever constants.
+    uint64_t strings_length = 0;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_STRING(value)) {
+            strings_length += AS_STRING(value)->length;
+        } else if (!IS_NUMBER(value)) {
+            return false;
+        }
+    }
+    if (strings_length > (uint64_t)INT_MAX - SOURCE_PADDING) return false;
+    header.strings_length = (uint32_t)strings_length;
+
+    size_t temp_size = strlen(path) + 32;
+    char* temp_path = (char*)malloc(temp_size);
+    if (temp_path == NULL) return false;
+#ifdef BYTECODE_CACHE
+    snprintf(temp_path, temp_size, "%s.%ld.tmp", path, (long)getpid());
+#else
+    snprintf(temp_path, temp_size, "%s.tmp", path);
+#endif /* ifdef BYTECODE_CACHE */
+
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        free(temp_path);
+        return false;
+    }
+    bool written = write_sections(chunk, &header, file);
+    written = fclose(file) == 0 && written;
+    if (written) {
+#ifndef BYTECODE_CACHE
+        // Only POSIX promises that rename() replaces an existing file.
+        remove(path);
+#endif /* ifndef BYTECODE_CACHE */
+        written = rename(temp_path, path) == 0;
+    }
+    if (!written) remove(temp_path);
+    free(temp_path);
+    return written;
+}
+
+// A loaded file. Interned strings may point into it until the VM is freed,
+// so they are only released by unmap_bytecode().
+typedef struct Mapping {
+    struct Mapping* next;
+    char* base;
+    size_t size;
+} Mapping;
+
+static Mapping* mappings = NULL;
+
+static void release_file(char* base, size_t size) {
+#ifdef MMAP_SOURCE
+    munmap(base, size);
+#else
+    (void)size;
+    free(base);
+#endif /* ifdef MMAP_SOURCE */
+}
+
+// Maps the file privately and writable, so run() can quicken the code in
+// place: the pages it touches are copied on write and the file is left
+// alone. Without mmap, the file is read into a buffer instead.
+static char* map_file(const char* path, size_t* size) {
+#ifdef MMAP_SOURCE
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+        (size_t)info.st_size < sizeof(BytecodeHeader)) {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t)info.st_size;
+    char* base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return base == MAP_FAILED ? NULL : base;
+#else
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    long file_size = -1;
+    if (fseek(file, 0L, SEEK_END) == 0) file_size = ftell(file);
+    rewind(file);
+    if (file_size < (long)sizeof(BytecodeHeader)) {
+        fclose(file);
+        return NULL;
+    }
+    *size = (size_t)file_size;
+    char* base = (char*)malloc(*size);
+    if (base != NULL && fread(base, 1, *size, file) != *size) {
+        free(base);
+        base = NULL;
+    }
+    fclose(file);
+    return base;
+#endif /* ifdef MMAP_SOURCE */
+}
+
+// Checks everything run() takes on trust: the sections fit in the file,
+// instructions don't run off the end of the code, constant operands are in
+// range, and every byte has a line. Opcodes themselves are checked when
+// the stack depth is computed.
+static bool check_file(const char* base, size_t size, const Layout* layout) {
+    const BytecodeHeader* header = (const BytecodeHeader*)base;
+    if (memcmp(header->magic, BYTECODE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BYTECODE_VERSION ||
+        header->compiler_version != COMPILER_VERSION ||
+        header->byte_order != BYTECODE_BYTE_ORDER ||
+        header->code_count > INT_MAX || header->line_count > INT_MAX ||
+        header->constant_count > CONSTANT_LONG_MAX + 1 ||
+        header->strings_length > (uint32_t)INT_MAX - SOURCE_PADDING ||
+        layout->end > size) {
+        return false;
+    }
+
+    // Something has to stop run(): the code must end in OP_RETURN.
+    if (header->code_count == 0) return false;
+
+    const uint8_t* code = (const uint8_t*)base + layout->code;
+    uint8_t last = 0;
+    for (uint32_t offset = 0; offset < header->code_count;) {
+        uint8_t instruction = code[offset];
+        if (instruction >= OP_COUNT) return false;
+        uint32_t length = (uint32_t)instruction_length(instruction);
+        if (offset + length > header->code_count) return false;
+
+        uint32_t constant = 0;
+        if (instruction == OP_CONSTANT_LONG) {
+            constant = ((uint32_t)code[offset + 1] << 16) |
+                       ((uint32_t)code[offset + 2] << 8) | code[offset + 3];
+        } else if (length == 2) {
+            constant = code[offset + 1];
+        }
+        if (length > 1 && constant >= header->constant_count) return false;
+        last = instruction;
+        offset += length;
+    }
+    if (last != OP_RETURN) return false;
+
+    const LineStart* lines = (const LineStart*)(base + layout->lines);
+    if (header->line_count == 0 || lines[0].offset != 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header->line_count; i++) {
+        if (lines[i].offset < 0 || (uint32_t)lines[i].offset >= header->code_count) return false;
+        if (i > 0 && lines[i].offset <= lines[i - 1].offset) return false;
+    }
+
+    const BytecodeConstant* constants = (const BytecodeConstant*)(base + layout->constants);
+    for (uint32_t i = 0; i < header->constant_count; i++) {
+        if (constants[i].tag == CONSTANT_NUMBER) {
+            // With NaN boxing, some NaNs would read back as objects.
+            double number;
+            memcpy(&number, &constants[i].payload, sizeof(number));
+            if (!IS_NUMBER(NUMBER_VAL(number))) return false;
+        } else if (constants[i].tag != CONSTANT_STRING ||
+                   constants[i].payload > header->strings_length ||
+                   constants[i].length > header->strings_length - constants[i].payload) {
+            return false;
+        }
+    }
+
+    // The padding stands in for the source's.
+    const char* padding = base + layout->strings + header->strings_length;
+    for (int i = 0; i < SOURCE_PADDING; i++) {
+        if (padding[i] != '\0') return false;
+    }
+    return true;
+}
+
+// Points `chunk` at the file's code and line table and rebuilds the
+// constants, with strings borrowed from the string section. `chunk` must
+// be reachable by the collector, e.g. as vm.chunk.
+static void fill_chunk(char* base, const Layout* layout, Chunk* chunk) {
+    const BytecodeHeader* header = (const BytecodeHeader*)base;
+    chunk->is_mapped = true;
+    chunk->code = (uint8_t*)base + layout->code;
+    chunk->count = (int)header->code_count;
+    chunk->capacity = chunk->count;
+    chunk->lines = (LineStart*)(base + layout->lines);
+    chunk->line_count = (int)header->line_count;
+    chunk->line_capacity = chunk->line_count;
+    chunk->source = borrow_source(base + layout->strings, (int)header->strings_length);
+
+    const BytecodeConstant* constants = (const BytecodeConstant*)(base + layout->constants);
+    for (uint32_t i = 0; i < header->constant_count; i++) {
+        Value value;
+        if (constants[i].tag == CONSTANT_NUMBER) {
+            double number;
+            memcpy(&number, &constants[i].payload, sizeof(number));
+            value = NUMBER_VAL(number);
+        } else {
+            ObjString* string = borrow_string(chunk->source,
+                                              chunk->source->chars + constants[i].payload,
+                                              (int)constants[i].length);
+            value = OBJ_VAL(intern_string(string));
+        }
+        push_root(value);
+        write_value_array(&chunk->constants, value);
+        pop_root();
+    }
+    compute_stack_size(chunk);
+}
+
+// Loads the file into `chunk` if it is valid and, when `key` is given,
+// was compiled from that source. Leaves `chunk` alone otherwise.
+static bool load_file(const char* path, const SourceKey* key, Chunk* chunk) {
+    size_t size;
+    char* base = map_file(path, &size);
+    if (base == NULL) return false;
+
+    const BytecodeHeader* header = (const BytecodeHeader*)base;
+    Layout layout;
+    lay_out(header, &layout);
+    if (!check_file(base, size, &layout) ||
+        (key != NULL && (header->source_hash != key->hash ||
+                         header->source_length != (uint32_t)key->length))) {
+        release_file(base, size);
+        return false;
+    }
+
+    Mapping* mapping = (Mapping*)malloc(sizeof(Mapping));
+    if (mapping == NULL) {
+        release_file(base, size);
+        return false;
+    }
+    mapping->base = base;
+    mapping->size = size;
+    mapping->next = mappings;
+    mappings = mapping;
+
+    fill_chunk(base, &layout, chunk);
+    return true;
+}
+
+bool load_bytecode(const char* path, Chunk* chunk) {
+    return load_file(path, NULL, chunk);
+}
+
+#ifdef BYTECODE_CACHE
+
+// The cached file for `key`, in a buffer reused by the next call. Static
+// rather than malloc'd, since loading can jump to heap_limit_handler while
+// the path is still held. NULL if the path doesn't fit.
+static const char* cache_path(SourceKey key) {
+    static char path[4096];
+    int length = snprintf(path, sizeof(path), "%s/%016llx" BYTECODE_EXTENSION,
+                          bytecode_cache.dir, (unsigned long long)key.hash);
+    return length < (int)sizeof(path) ? path : NULL;
+}
+
+// Like mkdir -p. Failures show up when the file is written.
+static void make_directories(const char* dir) {
+    char* path = strdup(dir);
+    if (path == NULL) return;
+    for (char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0777);
+        *slash = '/';
+    }
+    mkdir(path, 0777);
+    free(path);
+}
+
+#endif /* ifdef BYTECODE_CACHE */
+
+bool load_cached_chunk(SourceKey key, Chunk* chunk) {
+#ifdef BYTECODE_CACHE
+    if (bytecode_cache.dir == NULL) return false;
+    const char* path = cache_path(key);
+    if (path == NULL) return false;
+    return load_file(path, &key, chunk);
+#else
+    (void)key;
+    (void)chunk;
+    return false;
+#endif /* ifdef BYTECODE_CACHE */
+}
+
+// Best effort: a cache that can't be written is simply not used.
+void store_cached_chunk(SourceKey key, Chunk* chunk) {
+#ifdef BYTECODE_CACHE
+    if (bytecode_cache.dir == NULL || chunk->stack_size < 0) return;
+    const char* path = cache_path(key);
+    if (path == NULL) return;
+    make_directories(bytecode_cache.dir);
+    write_bytecode(chunk, key, path);
+#else
+    (void)key;
+    (void)chunk;
+#endif /* ifdef BYTECODE_CACHE */
+}
+
+void unmap_bytecode() {
+    while (mappings != NULL) {
+        Mapping* next = mappings->next;
+        release_file(mappings->base, mappings->size);
+        free(mappings);
+        mappings = next;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include <stdint.h>
+
+#define BYTECODE_EXTENSION ".loxc"
+
+// Where compiled chunks are kept between runs, named after a hash of their
+// source. NULL disables the cache.
+typedef struct {
+    const char* dir;
+} BytecodeCache;
+
+extern BytecodeCache bytecode_cache;
+
+// Identifies the source a .loxc file was compiled from, so a cached file
+// that no longer matches its script is never run.
+typedef struct {
+    uint64_t hash;
+    int length;
+} SourceKey;
+
+SourceKey source_key(ObjSource* source);
+bool write_bytecode(Chunk* chunk, SourceKey key, const char* path);
+bool load_bytecode(const char* path, Chunk* chunk);
+bool load_cached_chunk(SourceKey key, Chunk* chunk);
+void store_cached_chunk(SourceKey key, Chunk* chunk);
+void unmap_bytecode();
+
+#endif // !clox_bytecode_h
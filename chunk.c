@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -9,32 +10,273 @@ void init_chunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
     chunk->lines = NULL;
     init_value_array(&chunk->constants);
+    chunk->constant_slots = NULL;
+    chunk->constant_slots_count = 0;
+    chunk->constant_slots_capacity = 0;
+    chunk->stack_size = 0;
+    chunk->source = NULL;
+    chunk->is_mapped = false;
 }
 
 void free_chunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (!chunk->is_mapped) {
+        FREE_ARRAY(MEM_CODE, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(MEM_LINES, LineStart, chunk->lines, chunk->line_capacity);
+    }
     free_value_array(&chunk->constants);
+    FREE_ARRAY(MEM_CONSTANTS, int, chunk->constant_slots, chunk->constant_slots_capacity);
     init_chunk(chunk);
 }
 
 void write_chunk(Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
-        int old_capacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code,
-                                 old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines,
-                                  old_capacity, chunk->capacity);
+        int capacity = GROW_CAPACITY(chunk->capacity);
+        chunk->code = GROW_ARRAY(MEM_CODE, uint8_t, chunk->code,
+                                 chunk->capacity, capacity);
+        chunk->capacity = capacity;
     }
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    if (chunk->line_count > 0 &&
+        chunk->lines[chunk->line_count - 1].line == line) {
+        return;
+    }
+
+    if (chunk->line_capacity < chunk->line_count + 1) {
+        int capacity = GROW_CAPACITY(chunk->line_capacity);
+        chunk->lines = GROW_ARRAY(MEM_LINES, LineStart, chunk->lines,
+                                  chunk->line_capacity, capacity);
+        chunk->line_capacity = capacity;
+    }
+    LineStart* line_start = &chunk->lines[chunk->line_count++];
+    line_start->offset = chunk->count - 1;
+    line_start->line = line;
+}
+
+// Drops every byte from `count` on, along with the line runs that start there.
+void truncate_chunk(Chunk* chunk, int count) {
+    chunk->count = count;
+    while (chunk->line_count > 0 &&
+           chunk->lines[chunk->line_count - 1].offset >= count) {
+        chunk->line_count--;
+    }
+}
+
+int get_line(Chunk* chunk, int offset) {
+    int start = 0;
+    int end = chunk->line_count - 1;
+
+    // Find the last run starting at or before `offset`.
+    while (start < end) {
+        int mid = start + (end - start + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            start = mid;
+        } else {
+            end = mid - 1;
+        }
+    }
+    return chunk->lines[start].line;
+}
+
+int instruction_length(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_ADD_CONST:
+        case OP_SUBTRACT_CONST:
+        case OP_MULTIPLY_CONST:
+        case OP_DIVIDE_CONST:
+            return 2;
+        case OP_CONSTANT_LONG:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+// How many values `instruction` pops and then pushes. Returns false for
+// bytes that are not a known opcode.
+static bool stack_effect(uint8_t instruction, int* pops, int* pushes) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            *pops = 0; *pushes = 1;
+            return true;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_LESS_EQUAL_NUM:
+            *pops = 2; *pushes = 1;
+            return true;
+        case OP_ADD_CONST:
+        case OP_SUBTRACT_CONST:
+        case OP_MULTIPLY_CONST:
+        case OP_DIVIDE_CONST:
+        case OP_NOT:
+        case OP_NEGATE:
+            *pops = 1; *pushes = 1;
+            return true;
+        case OP_PRINT:
+            *pops = 1; *pushes = 0;
+            return true;
+        case OP_RETURN:
+            *pops = 0; *pushes = 0;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// Walks the code adding up each instruction's stack effect, so the VM can
+// size its stack up front instead of checking every push. There are no
+// jumps yet, so one pass in order visits every path.
+bool compute_stack_size(Chunk* chunk) {
+    int depth = 0;
+    int max_depth = 0;
+
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t instruction = chunk->code[offset];
+        int pops, pushes;
+        if (!stack_effect(instruction, &pops, &pushes) || depth < pops) {
+            chunk->stack_size = -1;
+            return false;
+        }
+
+        // OP_ADD_CONST pushes its constant before adding, so it briefly
+        // needs one slot above its operand.
+        if (instruction == OP_ADD_CONST && depth + 1 > max_depth) {
+            max_depth = depth + 1;
+        }
+
+        depth += pushes - pops;
+        if (depth > max_depth) max_depth = depth;
+        offset += instruction_length(instruction);
+        if (offset > chunk->count) {
+            chunk->stack_size = -1;
+            return false;
+        }
+    }
+
+    chunk->stack_size = max_depth;
+    return true;
+}
+
+#define CONSTANT_SLOTS_MAX_LOAD 0.75
+
+static uint32_t hash_constant(Value value) {
+    uint64_t bits = 0;
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        memcpy(&bits, &number, sizeof(bits));
+    } else if (IS_OBJ(value)) {
+        bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+    } else if (IS_BOOL(value)) {
+        bits = AS_BOOL(value) ? 2 : 1;
+    }
+
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// Numbers are compared bit for bit so 0 and -0 keep separate slots.
+static bool same_constant(Value a, Value b) {
+    if (IS_NUMBER(a) || IS_NUMBER(b)) {
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return values_equal(a, b);
+}
+
+// Returns the bucket holding `value`, or the empty bucket it would go in.
+static int* find_constant_slot(Chunk* chunk, Value value) {
+    uint32_t mask = chunk->constant_slots_capacity - 1;
+    uint32_t index = hash_constant(value) & mask;
+    for (;;) {
+        int* slot = &chunk->constant_slots[index];
+        if (*slot == -1 ||
+            same_constant(chunk->constants.values[*slot], value)) {
+            return slot;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static void rebuild_constant_slots(Chunk* chunk) {
+    int capacity = 8;
+    while (capacity * CONSTANT_SLOTS_MAX_LOAD < (chunk->constants.count + 1) * 2) {
+        capacity *= 2;
+    }
+
+    int* slots = ALLOCATE(MEM_CONSTANTS, int, capacity);
+    FREE_ARRAY(MEM_CONSTANTS, int, chunk->constant_slots, chunk->constant_slots_capacity);
+    chunk->constant_slots = slots;
+    chunk->constant_slots_capacity = capacity;
+    chunk->constant_slots_count = 0;
+    for (int i = 0; i < capacity; i++) chunk->constant_slots[i] = -1;
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        int* slot = find_constant_slot(chunk, chunk->constants.values[i]);
+        if (*slot != -1) continue;
+        *slot = i;
+        chunk->constant_slots_count++;
+    }
 }
 
 int add_constant(Chunk* chunk, Value value) {
+    if (chunk->constant_slots_count + 1 >
+        chunk->constant_slots_capacity * CONSTANT_SLOTS_MAX_LOAD) {
+        // Growing can collect, and `value` may not be referenced anywhere
+        // else yet.
+        push_root(value);
+        rebuild_constant_slots(chunk);
+        pop_root();
+    }
+
+    int* slot = find_constant_slot(chunk, value);
+    if (*slot != -1) return *slot;
+
+    push_root(value);
     write_value_array(&chunk->constants, value);
-    return chunk->constants.count - 1;
+    pop_root();
+    *slot = chunk->constants.count - 1;
+    chunk->constant_slots_count++;
+    return *slot;
+}
+
+// Takes back the most recently added constant. No bucket can have been
+// filled after its own, so emptying that bucket leaves every other probe
+// sequence intact.
+void remove_last_constant(Chunk* chunk) {
+    int* slot = find_constant_slot(chunk,
+        chunk->constants.values[chunk->constants.count - 1]);
+    *slot = -1;
+    chunk->constant_slots_count--;
+    chunk->constants.count--;
 }
@@ -4,35 +4,91 @@
 #include "value.h"
 #include <stdint.h>
 
+// Largest index an OP_CONSTANT_LONG operand can hold.
+#define CONSTANT_LONG_MAX 0xffffff
+
 typedef enum {
     OP_CONSTANT,
+    // Like OP_CONSTANT but with a 24-bit big-endian index, for pools past 256.
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    // Arithmetic with the right operand read from the constant pool.
+    OP_ADD_CONST,
+    OP_SUBTRACT_CONST,
+    OP_MULTIPLY_CONST,
+    OP_DIVIDE_CONST,
     OP_NOT,
     OP_NEGATE,
     OP_PRINT,
     OP_RETURN,
+    // Quickened forms. run() rewrites a generic instruction into one of these
+    // once it sees operands of that type, and back if the guard later fails.
+    // The compiler never emits them.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_EQUAL_NUM,
+    // Not an opcode: how many there are.
+    OP_COUNT,
 } OpCode;
 
+// The source line of every byte from `offset` up to the next LineStart.
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    // Run-length encoded line table, one entry per change of line.
+    int line_count;
+    int line_capacity;
+    LineStart* lines;
     ValueArray constants;
+    // Open-addressed index from a constant to its slot in `constants`, so
+    // identical numbers and strings share one slot. Empty buckets hold -1.
+    int* constant_slots;
+    int constant_slots_count;
+    int constant_slots_capacity;
+    // Deepest the value stack gets while running the chunk, as found by
+    // compute_stack_size(). -1 if the code would underflow the stack.
+    int stack_size;
+    // What the chunk was compiled from, or for a loaded .loxc file its
+    // string section. String constants may point into it. NULL for a
+    // batch of a streamed script, whose literals keep their own windows.
+    ObjSource* source;
+    // Whether `code` and `lines` point into a loaded .loxc file, which
+    // owns them, instead of the heap.
+    bool is_mapped;
 } Chunk;
 
 void init_chunk(Chunk* chunk);
 void free_chunk(Chunk* chunk);
 void write_chunk(Chunk* chunk, uint8_t byte, int line);
+void truncate_chunk(Chunk* chunk, int count);
+int get_line(Chunk* chunk, int offset);
+int instruction_length(uint8_t instruction);
+bool compute_stack_size(Chunk* chunk);
 int add_constant(Chunk* chunk, Value value);
+void remove_last_constant(Chunk* chunk);
 
 #endif // !clox_chunk_h
@@ -8,4 +8,58 @@
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
+// Pack every Value into a single NaN-boxed 64-bit word. Define NO_NAN_BOXING
+// to get the tagged-struct layout back, which is easier to inspect in a
+// debugger.
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+// Dispatch run() through a table of label addresses instead of a switch.
+// Needs the GNU labels-as-values extension; define NO_THREADED_DISPATCH to
+// force the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+// Hash strings eight bytes at a time with a wyhash-style multiply-mix.
+// Define NO_WORD_HASH to fall back to byte-at-a-time FNV-1a.
+#ifndef NO_WORD_HASH
+#define WORD_HASH
+#endif
+
+// Build with -DDEBUG_STRESS_GC to collect before every allocation that
+// grows the heap, and with -DDEBUG_LOG_GC to log each collection.
+
+// Serve objects and small buffers from size-class pools carved out of
+// large slabs. Define NO_POOL_ALLOCATOR to send every allocation straight
+// to malloc, e.g. for running under a memory checker.
+#ifndef NO_POOL_ALLOCATOR
+#define POOL_ALLOCATOR
+#endif
+
+// Map script files into memory instead of reading them into the heap.
+// Define NO_MMAP to always read them.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(NO_MMAP)
+#define MMAP_SOURCE
+#endif
+
+// Keep compiled chunks in a cache directory so unchanged scripts skip the
+// compiler. Define NO_BYTECODE_CACHE to always compile them.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(NO_BYTECODE_CACHE)
+#define BYTECODE_CACHE
+#endif
+
+// Lex large sources on a pool of threads before compiling them. Define
+// NO_THREADS to always scan tokens as the compiler asks for them.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(NO_THREADS)
+#define PARALLEL_SCAN
+#endif
+
+// Use the SSE2 versions of the hot loops that have one. Define NO_SIMD to
+// build the portable fallbacks instead.
+#if defined(__SSE2__) && !defined(NO_SIMD)
+#define SIMD_SSE2
+#endif
+
 #endif // !clox_common_h
@@ -1,16 +1,16 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "compiler.h"
 #include "chunk.h"
+#include "memory.h"
 #include "scanner.h"
+#include "stream.h"
+#include "tokens.h"
 #include "value.h"
 
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif /* ifdef DEBUG_PRINT_CODE */
-
 typedef struct {
     Token current;
     Token previous;
@@ -42,10 +42,30 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+// A position in the chunk being compiled: where the next byte of code and the
+// next new constant will go.
+typedef struct {
+    int offset;
+    int constants;
+} CodeMark;
+
 Parser parser;
 
 Chunk* compiling_chunk;
 
+// The pre-scanned tokens of a large source, or NULL to scan on demand.
+// They are kept here rather than in compile()'s frame so that they can
+// still be freed after the heap limit jumps out of it.
+static TokenStream pretokenized;
+static TokenStream* token_stream = NULL;
+
+// The script being read a window at a time, or NULL.
+static SourceStream* source_stream = NULL;
+
+// Where the innermost expression being parsed began, i.e. the start of an
+// infix operator's left operand.
+CodeMark operand_start;
+
 static Chunk* current_chunk() {
     return compiling_chunk;
 }
@@ -75,11 +95,17 @@ static void error_at_current(const char* message) {
     error_at(&parser.current, message);
 }
 
+static Token next_token() {
+    if (token_stream != NULL) return read_token(token_stream);
+    if (source_stream != NULL) return stream_token(source_stream);
+    return scan_token();
+}
+
 static void advance() {
     parser.previous = parser.current;
 
     for (;;) {
-        parser.current = scan_token();
+        parser.current = next_token();
         if (parser.current.type != TOKEN_ERROR) break;
 
         error_at_current(parser.current.start);
@@ -118,27 +144,261 @@ static void emit_return() {
     emit_byte(OP_RETURN);
 }
 
-static uint8_t make_constant(Value value) {
+static CodeMark mark_code() {
+    CodeMark mark;
+    mark.offset = current_chunk()->count;
+    mark.constants = current_chunk()->constants.count;
+    return mark;
+}
+
+static int make_constant(Value value) {
     int constant = add_constant(current_chunk(), value);
-    if (constant == UINT8_MAX) {
+    if (constant > CONSTANT_LONG_MAX) {
         error("Too many constants in one chunk");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
 static void emit_constant(Value value) {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+    int constant = make_constant(value);
+    if (constant <= UINT8_MAX) {
+        emit_bytes(OP_CONSTANT, (uint8_t)constant);
+    } else {
+        emit_byte(OP_CONSTANT_LONG);
+        emit_byte((uint8_t)(constant >> 16));
+        emit_byte((uint8_t)(constant >> 8));
+        emit_byte((uint8_t)constant);
+    }
+}
+
+// Returns the pool index of the OP_CONSTANT or OP_CONSTANT_LONG at `offset`.
+static int constant_index(Chunk* chunk, int offset) {
+    uint8_t* operand = &chunk->code[offset + 1];
+    if (chunk->code[offset] == OP_CONSTANT) return operand[0];
+    return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+static void emit_value(Value value) {
+    if (IS_NIL(value)) {
+        emit_byte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emit_constant(value);
+    }
+}
+
+// If the code in [start, end) is a single instruction pushing a value known
+// at compile time, stores that value and returns true.
+static bool constant_operand(int start, int end, Value* value) {
+    Chunk* chunk = current_chunk();
+    if (start >= end) return false;
+
+    switch (chunk->code[start]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            if (end - start != instruction_length(chunk->code[start])) return false;
+            *value = chunk->constants.values[constant_index(chunk, start)];
+            return true;
+        case OP_NIL:    *value = NIL_VAL;           break;
+        case OP_TRUE:   *value = BOOL_VAL(true);    break;
+        case OP_FALSE:  *value = BOOL_VAL(false);   break;
+
+        default: return false;
+    }
+    return end - start == 1;
+}
+
+// Drops the constant instruction at `start`. Its pool entry goes too when
+// the instruction added it and nothing was added after it; a deduplicated
+// entry may still be used by earlier code.
+static void discard_constant(CodeMark start) {
+    Chunk* chunk = current_chunk();
+    uint8_t instruction = chunk->code[start.offset];
+    if (instruction == OP_CONSTANT || instruction == OP_CONSTANT_LONG) {
+        int constant = constant_index(chunk, start.offset);
+        if (constant >= start.constants && constant == chunk->constants.count - 1) {
+            remove_last_constant(chunk);
+        }
+    }
+    truncate_chunk(chunk, start.offset);
+}
+
+// Constants are interned so the chunk's constant index can match them by
+// identity.
+static Value concatenate_constants(ObjString* a, ObjString* b) {
+    ObjString* result = allocate_string(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+    return OBJ_VAL(intern_string(result));
+}
+
+// Evaluates `a operator b` at compile time. Returns false when the operation
+// would fail at runtime, so the error is still reported there.
+static bool evaluate_binary(TokenType operator_type, Value a, Value b, Value* result) {
+    switch (operator_type) {
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!values_equal(a, b));  return true;
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(values_equal(a, b));   return true;
+        case TOKEN_PLUS:
+            if (IS_STRING(a) && IS_STRING(b)) {
+                *result = concatenate_constants(AS_STRING(a), AS_STRING(b));
+                return true;
+            }
+            break;
+
+        default: break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operator_type) {
+        case TOKEN_GREATER:         *result = BOOL_VAL(x > y);      return true;
+        case TOKEN_GREATER_EQUAL:   *result = BOOL_VAL(!(x < y));   return true;
+        case TOKEN_LESS:            *result = BOOL_VAL(x < y);      return true;
+        case TOKEN_LESS_EQUAL:      *result = BOOL_VAL(!(x > y));   return true;
+        case TOKEN_PLUS:            *result = NUMBER_VAL(x + y);    return true;
+        case TOKEN_MINUS:           *result = NUMBER_VAL(x - y);    return true;
+        case TOKEN_STAR:            *result = NUMBER_VAL(x * y);    return true;
+        case TOKEN_SLASH:           *result = NUMBER_VAL(x / y);    return true;
+
+        default: return false;
+    }
+}
+
+static bool fold_binary(TokenType operator_type, CodeMark left_start, CodeMark right_start) {
+    Value a, b, result;
+    if (!constant_operand(left_start.offset, right_start.offset, &a)) return false;
+    if (!constant_operand(right_start.offset, current_chunk()->count, &b)) return false;
+    if (!evaluate_binary(operator_type, a, b, &result)) return false;
+
+    discard_constant(right_start);
+    discard_constant(left_start);
+    emit_value(result);
+    return true;
+}
+
+static bool fold_unary(TokenType operator_type, CodeMark start) {
+    Value operand;
+    if (!constant_operand(start.offset, current_chunk()->count, &operand)) return false;
+
+    Value result;
+    switch (operator_type) {
+        case TOKEN_BANG:
+            result = BOOL_VAL(IS_NIL(operand) || (IS_BOOL(operand) && !AS_BOOL(operand)));
+            break;
+        case TOKEN_MINUS:
+            if (!IS_NUMBER(operand)) return false;
+            result = NUMBER_VAL(-AS_NUMBER(operand));
+            break;
+
+        default: return false;
+    }
+
+    discard_constant(start);
+    emit_value(result);
+    return true;
+}
+
+// Turns `OP_CONSTANT k` as the right operand of an arithmetic operator into
+// the matching `OP_*_CONST k` superinstruction.
+static bool fuse_constant_operand(TokenType operator_type, CodeMark right_start) {
+    Chunk* chunk = current_chunk();
+    uint8_t* instruction = &chunk->code[right_start.offset];
+    if (chunk->count - right_start.offset != 2 || *instruction != OP_CONSTANT) {
+        return false;
+    }
+
+    switch (operator_type) {
+        case TOKEN_PLUS:    *instruction = OP_ADD_CONST;        break;
+        case TOKEN_MINUS:   *instruction = OP_SUBTRACT_CONST;   break;
+        case TOKEN_STAR:    *instruction = OP_MULTIPLY_CONST;   break;
+        case TOKEN_SLASH:   *instruction = OP_DIVIDE_CONST;     break;
+
+        default: return false;
+    }
+    return true;
+}
+
+
+static bool produces_bool(uint8_t instruction) {
+    switch (instruction) {
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_NOT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool produces_number(uint8_t instruction) {
+    switch (instruction) {
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_SUBTRACT_CONST:
+        case OP_MULTIPLY_CONST:
+        case OP_DIVIDE_CONST:
+        case OP_NEGATE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Rewrites the finished chunk in place, dropping instruction pairs that
+// cancel out given what the instruction before them leaves on the stack.
+static void peephole(Chunk* chunk) {
+    // Kept instructions are re-appended over the same code array, which is
+    // safe because output never overtakes input. `original` keeps the old
+    // line table for lookups while write_chunk() builds the new one.
+    Chunk original = *chunk;
+    chunk->count = 0;
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
+    chunk->lines = NULL;
+    hold_scratch(MEM_LINES, original.lines, sizeof(LineStart) * original.line_capacity);
+
+    int last = -1;
+    for (int read = 0; read < original.count;) {
+        uint8_t instruction = original.code[read];
+        if (last != -1 && read + 1 < original.count &&
+            original.code[read + 1] == instruction) {
+            uint8_t previous = chunk->code[last];
+            if ((instruction == OP_NOT && produces_bool(previous)) ||
+                (instruction == OP_NEGATE && produces_number(previous))) {
+                read += 2;
+                continue;
+            }
+        }
+
+        last = chunk->count;
+        int line = get_line(&original, read);
+        int length = instruction_length(instruction);
+        for (int i = 0; i < length; i++, read++) {
+            write_chunk(chunk, original.code[read], line);
+        }
+    }
+
+    release_scratch();
+    FREE_ARRAY(MEM_LINES, LineStart, original.lines, original.line_capacity);
 }
 
 static void end_compiler() {
     emit_return();
-#ifdef DEBUG_PRINT_CODE
     if (!parser.had_error) {
-        disassemble_chunk(current_chunk(), "code");
+        peephole(current_chunk());
+        compute_stack_size(current_chunk());
     }
-#endif /* ifdef DEBUG_PRINT_CODE */
 }
 
 static void expression();
@@ -150,16 +410,21 @@ static void parse_precedence(Precedence);
 
 static void binary() {
     TokenType operator_type = parser.previous.type;
+    CodeMark left_start = operand_start;
+    CodeMark right_start = mark_code();
     ParseRule* rule = get_rule(operator_type);
     parse_precedence((Precedence) (rule->precedence + 1));
 
+    if (fold_binary(operator_type, left_start, right_start)) return;
+    if (fuse_constant_operand(operator_type, right_start)) return;
+
     switch (operator_type) {
-        case TOKEN_BANG_EQUAL:      emit_bytes(OP_EQUAL, OP_NOT);   break;
+        case TOKEN_BANG_EQUAL:      emit_byte(OP_NOT_EQUAL);        break;
         case TOKEN_EQUAL_EQUAL:     emit_byte(OP_EQUAL);            break;
         case TOKEN_GREATER:         emit_byte(OP_GREATER);          break;
-        case TOKEN_GREATER_EQUAL:   emit_bytes(OP_LESS, OP_NOT);    break;
+        case TOKEN_GREATER_EQUAL:   emit_byte(OP_GREATER_EQUAL);    break;
         case TOKEN_LESS:            emit_byte(OP_LESS);             break;
-        case TOKEN_LESS_EQUAL:      emit_bytes(OP_GREATER, OP_NOT); break;
+        case TOKEN_LESS_EQUAL:      emit_byte(OP_LESS_EQUAL);       break;
         case TOKEN_PLUS:            emit_byte(OP_ADD);              break;
         case TOKEN_MINUS:           emit_byte(OP_SUBTRACT);         break;
         case TOKEN_STAR:            emit_byte(OP_MULTIPLY);         break;
@@ -199,16 +464,26 @@ static void number() {
     emit_constant(NUMBER_VAL(value));
 }
 
+// The literal's characters stay in the source buffer, or in a streamed
+// script the window they were read into.
 static void string() {
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+    ObjSource* source = source_stream != NULL
+        ? stream_source_of(source_stream, parser.previous.start)
+        : current_chunk()->source;
+    ObjString* string = borrow_string(source, parser.previous.start + 1,
+                                      parser.previous.length - 2);
+    emit_constant(OBJ_VAL(intern_string(string)));
 }
 
 static void unary() {
     TokenType operator_type = parser.previous.type;
+    CodeMark start = mark_code();
     
     // Compiling operand
     parse_precedence(PREC_UNARY);
 
+    if (fold_unary(operator_type, start)) return;
+
     switch (operator_type) {
         case TOKEN_BANG:    emit_byte(OP_NOT);      break;
         case TOKEN_MINUS:   emit_byte(OP_NEGATE);   break;
@@ -270,10 +545,12 @@ static void parse_precedence(Precedence precedence) {
         return;
     }
 
+    CodeMark start = mark_code();
     prefix_rule();
 
     while (precedence <= get_rule(parser.current.type)->precedence) {
         advance();
+        operand_start = start;
         ParseRule* rule = get_rule(parser.previous.type);
         ParseFn infix_rule = rule->infix;
         ParseFn mixfix_rule = rule->mixfix;
@@ -309,8 +586,11 @@ static void statement() {
     }
 }
 
-bool compile(const char* source, Chunk* chunk) {
-    init_scanner(source);
+bool compile(ObjSource* source, Chunk* chunk) {
+    token_stream = pretokenize(&pretokenized, source->chars, source->length)
+        ? &pretokenized : NULL;
+    init_scanner(source->chars);
+    chunk->source = source;
     compiling_chunk = chunk;
 
     parser.had_error = false;
@@ -322,5 +602,52 @@ bool compile(const char* source, Chunk* chunk) {
         declaration();
     }
     end_compiler();
+    compiling_chunk = NULL;
+    stop_pretokenized();
+    return !parser.had_error;
+}
+
+// Frees the tokens compile() scanned ahead, if it didn't get to.
+void stop_pretokenized() {
+    if (token_stream != NULL) free_token_stream(token_stream);
+    token_stream = NULL;
+}
+
+// Reads the first token of `stream`. The compiler then holds on to it,
+// and keeps its windows alive, until stop_streaming().
+void start_streaming(SourceStream* stream) {
+    source_stream = stream;
+    parser.had_error = false;
+    parser.panic_mode = false;
+    advance();
+}
+
+// Compiles statements from the stream into `chunk` until it holds at least
+// STREAM_BATCH_SIZE bytes of code or the input ends. Statements are never
+// split, so each batch runs on its own.
+bool compile_batch(Chunk* chunk) {
+    compiling_chunk = chunk;
+    while (!check(TOKEN_EOF) && chunk->count < STREAM_BATCH_SIZE) {
+        declaration();
+    }
+    end_compiler();
+    compiling_chunk = NULL;
     return !parser.had_error;
 }
+
+bool stream_finished() {
+    return check(TOKEN_EOF);
+}
+
+void stop_streaming() {
+    source_stream = NULL;
+}
+
+void mark_compiler_roots() {
+    if (source_stream != NULL) mark_source_stream(source_stream);
+    if (compiling_chunk == NULL) return;
+    for (int i = 0; i < compiling_chunk->constants.count; i++) {
+        mark_value(compiling_chunk->constants.values[i]);
+    }
+    mark_object((Obj*)compiling_chunk->source);
+}
@@ -3,6 +3,18 @@
 
 #include "object.h"
 #include "chunk.h"
-bool compile(const char* source, Chunk* chunk);
+#include "stream.h"
+
+// Bump whenever the same source compiles to different code, so .loxc files
+// written by an older compiler are recompiled rather than run.
+#define COMPILER_VERSION 1
+
+bool compile(ObjSource* source, Chunk* chunk);
+void stop_pretokenized();
+void start_streaming(SourceStream* stream);
+bool compile_batch(Chunk* chunk);
+bool stream_finished();
+void stop_streaming();
+void mark_compiler_roots();
 
 #endif // !clox_compiler_h
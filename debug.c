@@ -4,6 +4,50 @@
 #include "debug.h"
 #include "chunk.h"
 
+static const char* opcode_names[OP_COUNT] = {
+    [OP_CONSTANT]       = "OP_CONSTANT",
+    [OP_CONSTANT_LONG]  = "OP_CONSTANT_LONG",
+    [OP_NIL]            = "OP_NIL",
+    [OP_TRUE]           = "OP_TRUE",
+    [OP_FALSE]          = "OP_FALSE",
+    [OP_EQUAL]          = "OP_EQUAL",
+    [OP_GREATER]        = "OP_GREATER",
+    [OP_LESS]           = "OP_LESS",
+    [OP_NOT_EQUAL]      = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL]  = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL]     = "OP_LESS_EQUAL",
+    [OP_ADD]            = "OP_ADD",
+    [OP_SUBTRACT]       = "OP_SUBTRACT",
+    [OP_MULTIPLY]       = "OP_MULTIPLY",
+    [OP_DIVIDE]         = "OP_DIVIDE",
+    [OP_ADD_CONST]      = "OP_ADD_CONST",
+    [OP_SUBTRACT_CONST] = "OP_SUBTRACT_CONST",
+    [OP_MULTIPLY_CONST] = "OP_MULTIPLY_CONST",
+    [OP_DIVIDE_CONST]   = "OP_DIVIDE_CONST",
+    [OP_NOT]            = "OP_NOT",
+    [OP_NEGATE]         = "OP_NEGATE",
+    [OP_PRINT]          = "OP_PRINT",
+    [OP_RETURN]         = "OP_RETURN",
+    [OP_ADD_NUM]         = "OP_ADD_NUM",
+    [OP_ADD_STR]         = "OP_ADD_STR",
+    [OP_SUBTRACT_NUM]    = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM]    = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM]      = "OP_DIVIDE_NUM",
+    [OP_GREATER_NUM]     = "OP_GREATER_NUM",
+    [OP_LESS_NUM]        = "OP_LESS_NUM",
+    [OP_GREATER_EQUAL_NUM] = "OP_GREATER_EQUAL_NUM",
+    [OP_LESS_EQUAL_NUM]  = "OP_LESS_EQUAL_NUM",
+};
+
+static bool is_opcode(uint8_t instruction) {
+    return instruction < OP_COUNT &&
+           opcode_names[instruction] != NULL;
+}
+
+const char* opcode_name(uint8_t instruction) {
+    return is_opcode(instruction) ? opcode_names[instruction] : "OP_UNKNOWN";
+}
+
 void disassemble_chunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
     for (int offset = 0; offset < chunk->count;) {
@@ -11,6 +55,21 @@ void disassemble_chunk(Chunk* chunk, const char* name) {
     }
 }
 
+// Reports how much memory the chunk's code and line table take, and what a
+// table with one int per code byte would have cost instead.
+void print_chunk_memory(FILE* out, Chunk* chunk) {
+    size_t code_bytes = sizeof(uint8_t) * chunk->count;
+    size_t line_bytes = sizeof(LineStart) * chunk->line_count;
+    size_t flat_line_bytes = sizeof(int) * chunk->count;
+
+    fprintf(out, "== chunk memory ==\n");
+    fprintf(out, "code        %10zu bytes\n", code_bytes);
+    fprintf(out, "lines       %10zu bytes (%d runs, %zu bytes as one int per byte)\n",
+            line_bytes, chunk->line_count, flat_line_bytes);
+    fprintf(out, "constants   %10zu bytes (%d values)\n",
+            sizeof(Value) * chunk->constants.count, chunk->constants.count);
+}
+
 static int simple_instruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -24,48 +83,42 @@ static int constant_instruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int constant_long_instruction(const char* name, Chunk* chunk, int offset) {
+    uint32_t constant = (chunk->code[offset + 1] << 16) |
+                        (chunk->code[offset + 2] << 8) |
+                        chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 int disassemble_instruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = get_line(chunk, offset);
+    if (offset > 0 && line == get_line(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
+    if (!is_opcode(instruction)) {
+        printf("Unknown opcode %d\n", instruction);
+        return offset + 1;
+    }
+
+    const char* name = opcode_name(instruction);
     switch (instruction) {
-        case OP_RETURN:
-            return simple_instruction("OP_RETURN", offset);
-        case OP_PRINT:
-            return simple_instruction("OP_PRINT", offset);
         case OP_CONSTANT:
-            return constant_instruction("OP_CONSTANT", chunk, offset);
-        case OP_NIL:
-            return simple_instruction("OP_NIL", offset);
-        case OP_TRUE:
-            return simple_instruction("OP_TRUE", offset);
-        case OP_FALSE:
-            return simple_instruction("OP_FALSE", offset);
-        case OP_EQUAL:
-            return simple_instruction("OP_EQUAL", offset);
-        case OP_GREATER:
-            return simple_instruction("OP_GREATER", offset);
-        case OP_LESS:
-            return simple_instruction("OP_LESS", offset);
-        case OP_ADD:
-            return simple_instruction("OP_ADD", offset);
-        case OP_SUBTRACT:
-            return simple_instruction("OP_SUBTRACT", offset);
-        case OP_MULTIPLY:
-            return simple_instruction("OP_MULTIPLY", offset);
-        case OP_DIVIDE:
-            return simple_instruction("OP_DIVIDE", offset);
-        case OP_NOT:
-            return simple_instruction("OP_NOT", offset);
-        case OP_NEGATE:
-            return simple_instruction("OP_NEGATE", offset);
+        case OP_ADD_CONST:
+        case OP_SUBTRACT_CONST:
+        case OP_MULTIPLY_CONST:
+        case OP_DIVIDE_CONST:
+            return constant_instruction(name, chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constant_long_instruction(name, chunk, offset);
         default:
-            printf("Unknown opcode %d\n", instruction);
-            return offset + 1;
+            return simple_instruction(name, offset);
     }
 }
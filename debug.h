@@ -2,8 +2,11 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include <stdio.h>
 
 void disassemble_chunk(Chunk* chunk, const char* name);
 int disassemble_instruction(Chunk* chunk, int offset);
+void print_chunk_memory(FILE* out, Chunk* chunk);
+const char* opcode_name(uint8_t instruction);
 
 #endif // !clox_debug_h
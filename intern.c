@@ -0,0 +1,145 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+
+#define INTERN_MAX_LOAD 0.75
+// intern_shrink() only bothers when the set is at most this full.
+#define INTERN_MIN_LOAD 0.25
+#define INTERN_MIN_CAPACITY 8
+
+#define HASH_EMPTY      0u
+#define HASH_DELETED    1u
+
+void init_intern_set(InternSet* set) {
+    set->count = 0;
+    set->tombstones = 0;
+    set->capacity = 0;
+    set->hashes = NULL;
+    set->strings = NULL;
+}
+
+void free_intern_set(InternSet* set) {
+    FREE_ARRAY(MEM_TABLES, uint32_t, set->hashes, set->capacity);
+    FREE_ARRAY(MEM_TABLES, ObjString*, set->strings, set->capacity);
+    init_intern_set(set);
+}
+
+static uint32_t stored_hash(uint32_t hash) {
+    return hash <= HASH_DELETED ? hash + 2 : hash;
+}
+
+static void adjust_capacity(InternSet* set, int capacity) {
+    uint32_t* hashes = ALLOCATE(MEM_TABLES, uint32_t, capacity);
+    hold_scratch(MEM_TABLES, hashes, sizeof(uint32_t) * capacity);
+    ObjString** strings = ALLOCATE(MEM_TABLES, ObjString*, capacity);
+    release_scratch();
+
+    uint32_t* old_hashes = set->hashes;
+    ObjString** old_strings = set->strings;
+    int old_capacity = set->capacity;
+
+    set->hashes = hashes;
+    set->strings = strings;
+    set->capacity = capacity;
+    set->tombstones = 0;
+    memset(set->hashes, 0, sizeof(uint32_t) * capacity);
+
+    uint32_t mask = capacity - 1;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_hashes[i] <= HASH_DELETED) continue;
+
+        uint32_t index = old_hashes[i] & mask;
+        while (set->hashes[index] != HASH_EMPTY) index = (index + 1) & mask;
+        set->hashes[index] = old_hashes[i];
+        set->strings[index] = old_strings[i];
+    }
+
+    FREE_ARRAY(MEM_TABLES, uint32_t, old_hashes, old_capacity);
+    FREE_ARRAY(MEM_TABLES, ObjString*, old_strings, old_capacity);
+}
+
+ObjString* intern_find(InternSet* set, const char* chars, int length, uint32_t hash) {
+    if (set->count == 0) return NULL;
+
+    uint32_t key = stored_hash(hash);
+    uint32_t mask = set->capacity - 1;
+    for (uint32_t index = key & mask;; index = (index + 1) & mask) {
+        uint32_t slot_hash = set->hashes[index];
+        if (slot_hash == HASH_EMPTY) return NULL;
+        if (slot_hash != key) continue;
+
+        ObjString* string = set->strings[index];
+        if (string->length == length && memcmp(string->chars, chars, length) == 0) {
+            return string;
+        }
+    }
+}
+
+// Adds a string the caller has already checked is not in the set.
+void intern_add(InternSet* set, ObjString* string) {
+    if (set->count + set->tombstones + 1 > set->capacity * INTERN_MAX_LOAD) {
+        int capacity = set->capacity;
+        if (set->count + 1 > capacity * INTERN_MAX_LOAD / 2) {
+            capacity = GROW_CAPACITY(capacity);
+        }
+        adjust_capacity(set, capacity);
+    }
+
+    uint32_t key = stored_hash(string->hash);
+    uint32_t mask = set->capacity - 1;
+    uint32_t index = key & mask;
+    while (set->hashes[index] > HASH_DELETED) index = (index + 1) & mask;
+
+    if (set->hashes[index] == HASH_DELETED) set->tombstones--;
+    set->hashes[index] = key;
+    set->strings[index] = string;
+    set->count++;
+}
+
+// Removes `string` itself, compared by address, e.g. when it is freed.
+bool intern_remove(InternSet* set, ObjString* string) {
+    if (set->count == 0) return false;
+
+    uint32_t key = stored_hash(string->hash);
+    uint32_t mask = set->capacity - 1;
+    for (uint32_t index = key & mask;; index = (index + 1) & mask) {
+        uint32_t slot_hash = set->hashes[index];
+        if (slot_hash == HASH_EMPTY) return false;
+        if (slot_hash == key && set->strings[index] == string) {
+            set->hashes[index] = HASH_DELETED;
+            set->count--;
+            set->tombstones++;
+            return true;
+        }
+    }
+}
+
+// Deletes every string the collector did not mark, just before they are
+// freed.
+void intern_remove_white(InternSet* set) {
+    for (int i = 0; i < set->capacity; i++) {
+        if (set->hashes[i] <= HASH_DELETED || set->strings[i]->obj.is_marked) continue;
+        set->hashes[i] = HASH_DELETED;
+        set->count--;
+        set->tombstones++;
+    }
+}
+
+// Rehashes into a smaller array once many strings have been removed. Meant
+// to run after a batch of removals rather than after each one.
+void intern_shrink(InternSet* set) {
+    if (set->capacity <= INTERN_MIN_CAPACITY ||
+        set->count > set->capacity * INTERN_MIN_LOAD) {
+        return;
+    }
+
+    int capacity = set->capacity;
+    while (capacity > INTERN_MIN_CAPACITY &&
+           set->count <= capacity / 2 * INTERN_MIN_LOAD) {
+        capacity /= 2;
+    }
+    adjust_capacity(set, capacity);
+}
@@ -0,0 +1,29 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "object.h"
+#include <stdint.h>
+
+// The set of interned strings. Unlike a Table it stores only the string
+// pointers, with each slot's hash kept in a parallel array so a probe can
+// reject a candidate without loading the string it points to.
+typedef struct {
+    int count;
+    int tombstones;
+    int capacity;
+    // 0 marks an empty slot and 1 a deleted one; real hashes are remapped
+    // out of that range by stored_hash().
+    uint32_t* hashes;
+    ObjString** strings;
+} InternSet;
+
+void init_intern_set(InternSet* set);
+void free_intern_set(InternSet* set);
+ObjString* intern_find(InternSet* set, const char* chars, int length, uint32_t hash);
+void intern_add(InternSet* set, ObjString* string);
+bool intern_remove(InternSet* set, ObjString* string);
+void intern_remove_white(InternSet* set);
+void intern_shrink(InternSet* set);
+
+#endif // !clox_intern_h
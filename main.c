@@ -1,7 +1,27 @@
+// MAP_ANONYMOUS and madvise() are not POSIX; glibc hides them otherwise.
+#define _DEFAULT_SOURCE
+
+#include "bench.h"
+#include "bytecode.h"
+#include "memory.h"
+#include "object.h"
+#include "profiler.h"
+#include "trace.h"
 #include "vm.h"
+#include <ctype.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef MMAP_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /* ifdef MMAP_SOURCE */
+
+#define PROFILE_JSON_PATH "clox-profile.json"
 
 static void repl() {
     char line[1024];
@@ -17,58 +37,355 @@ static void repl() {
     }
 }
 
-static char* read_file(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file\"%s\".\n", path);
+// Sources are indexed with ints, including their padding.
+static void check_source_size(size_t size, const char* path) {
+    if (size > (size_t)INT_MAX - sizeof(ObjSource) - SOURCE_PADDING) {
+        fprintf(stderr, "File \"%s\" is too large to compile.\n", path);
         exit(74);
     }
+}
 
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+#ifdef MMAP_SOURCE
 
-    char* buffer = (char*)malloc(file_size + 1);
-    if (buffer == NULL) {
-        fprintf(stderr,
-                "Could not allocate the %zug bytes of memory needed to read the file "
-                "\"%s\".\n",
-                file_size,
-                path);
-        exit(74);
+// The file behind a mapped source. Strings may point into it until the VM
+// is freed, so it is only unmapped after that.
+static char* mapped_source = NULL;
+static size_t mapped_size = 0;
+
+// Maps a regular file read-only, followed by the zero padding the scanner
+// expects. Returns NULL for pipes, terminals and empty files, and if
+// mapping fails, so the caller can read them instead.
+static ObjSource* map_source(FILE* file, const char* path) {
+    struct stat info;
+    int fd = fileno(file);
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0) {
+        return NULL;
+    }
+    size_t length = (size_t)info.st_size;
+    check_source_size(length, path);
+
+    // Reserve whole zero-filled pages for the file plus its padding and
+    // map the file over the start. The tail of the file's last page reads
+    // as zero too, so the reservation only adds a page when the file ends
+    // close to a page boundary.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (length + SOURCE_PADDING + page - 1) / page * page;
+    char* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    if (mmap(base, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, size);
+        return NULL;
     }
-    size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
-    if (bytes_read < file_size) {
+    // The scanner reads it once, front to back.
+    madvise(base, length, MADV_SEQUENTIAL);
+
+    mapped_source = base;
+    mapped_size = size;
+    return borrow_source(base, (int)length);
+}
+
+static void unmap_source() {
+    if (mapped_source == NULL) return;
+    munmap(mapped_source, mapped_size);
+    mapped_source = NULL;
+    mapped_size = 0;
+}
+
+#endif /* ifdef MMAP_SOURCE */
+
+// Reads a file whose size can't be known up front, e.g. a pipe.
+static ObjSource* read_stream(FILE* file, const char* path) {
+    char* buffer = NULL;
+    size_t capacity = 0;
+    size_t length = 0;
+    for (;;) {
+        if (length == capacity) {
+            capacity = capacity < 65536 ? 65536 : capacity * 2;
+            buffer = (char*)realloc(buffer, capacity);
+            if (buffer == NULL) {
+                fprintf(stderr, "Could not allocate memory to read \"%s\".\n", path);
+                exit(74);
+            }
+        }
+        size_t bytes_read = fread(buffer + length, sizeof(char), capacity - length, file);
+        length += bytes_read;
+        if (bytes_read == 0) break;
+    }
+    if (ferror(file)) {
         fprintf(stderr, "Could not read file \"%s\"", path);
         exit(74);
     }
-    buffer[bytes_read] = '\0';
+    check_source_size(length, path);
+
+    ObjSource* source = copy_source(buffer, (int)length);
+    free(buffer);
+    return source;
+}
+
+// "-" opens standard input.
+static FILE* open_script(const char* path) {
+    FILE* file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file\"%s\".\n", path);
+        exit(74);
+    }
+    return file;
+}
+
+static void close_script(FILE* file) {
+    if (file != stdin) fclose(file);
+}
+
+// Maps the file when it can, and otherwise reads it straight into a source
+// object, so string literals can borrow from it without a second copy.
+static ObjSource* read_source(const char* path) {
+    FILE* file = open_script(path);
+    ObjSource* source = NULL;
+#ifdef MMAP_SOURCE
+    source = map_source(file, path);
+#endif /* ifdef MMAP_SOURCE */
+
+    if (source == NULL) {
+        long file_size = -1;
+        if (fseek(file, 0L, SEEK_END) == 0) {
+            file_size = ftell(file);
+            rewind(file);
+        }
+
+        if (file_size < 0) {
+            source = read_stream(file, path);
+        } else {
+            check_source_size((size_t)file_size, path);
+            source = allocate_source((int)file_size);
+            size_t bytes_read = fread(source->chars, sizeof(char), file_size, file);
+            if (bytes_read < (size_t)file_size) {
+                fprintf(stderr, "Could not read file \"%s\"", path);
+                exit(74);
+            }
+        }
+    }
 
-    fclose(file);
-    return buffer;
+    close_script(file);
+    return source;
 }
 
-static void run_file(const char* path) {
-    char* source = read_file(path);
-    InterpretResult result = interpret(source);
-    free(source);
+static bool is_bytecode_path(const char* path) {
+    size_t length = strlen(path);
+    size_t extension = strlen(BYTECODE_EXTENSION);
+    return length > extension && strcmp(path + length - extension, BYTECODE_EXTENSION) == 0;
+}
 
+static void exit_on_error(InterpretResult result) {
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_IO_ERROR) exit(74);
+}
+
+// With `stream` set, the script is compiled and run a window at a time
+// rather than read whole first, which keeps memory bounded for long pipes.
+static void run_file(const char* path, bool stream) {
+    if (is_bytecode_path(path)) {
+        exit_on_error(interpret_bytecode(path));
+        return;
+    }
+
+    if (stream) {
+        FILE* file = open_script(path);
+        InterpretResult result = interpret_file_stream(file);
+        close_script(file);
+        exit_on_error(result);
+        return;
+    }
+    exit_on_error(interpret_source(read_source(path)));
+}
+
+static void compile_file(const char* path, const char* output_path) {
+    exit_on_error(compile_to_bytecode(read_source(path), output_path));
+}
+
+// $CLOX_CACHE_DIR, or clox/ under the user's cache directory.
+static const char* default_cache_dir() {
+    static char dir[4096];
+    const char* configured = getenv("CLOX_CACHE_DIR");
+    if (configured != NULL && configured[0] != '\0') return configured;
+
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int length;
+    if (xdg != NULL && xdg[0] != '\0') {
+        length = snprintf(dir, sizeof(dir), "%s/clox", xdg);
+    } else if (home != NULL && home[0] != '\0') {
+        length = snprintf(dir, sizeof(dir), "%s/.cache/clox", home);
+    } else {
+        return NULL;
+    }
+    return length < (int)sizeof(dir) ? dir : NULL;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [--profile] [--trace file] [--mem-stats] "
+                    "[--max-heap bytes[k|m|g]] [--no-cache] [--stream] [path | -]\n"
+                    "       clox --compile-only -o out" BYTECODE_EXTENSION " path\n"
+                    "       clox --decode-trace file path\n"
+                    "       clox --lex-bench path\n"
+                    "       clox --hash-bench path\n"
+                    "       clox --rope-bench\n");
+    exit(64);
+}
+
+static void decode_trace_file(const char* trace_path, const char* path) {
+    if (!decode_trace(trace_path, read_source(path))) exit(65);
+}
+
+static void save_trace() {
+    if (!dump_trace()) {
+        fprintf(stderr, "Could not write execution trace.\n");
+    }
+}
+
+static void report_memory() {
+    print_memory_stats(stderr);
+}
+
+// Parses a byte count with an optional k, m or g suffix.
+static size_t parse_size(const char* text) {
+    char* end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text || text[0] == '-') usage();
+
+    int shift = 0;
+    switch (tolower((unsigned char)*end)) {
+        case '\0': break;
+        case 'k': shift = 10; end++; break;
+        case 'm': shift = 20; end++; break;
+        case 'g': shift = 30; end++; break;
+        default: usage();
+    }
+    if (*end != '\0' || size > (SIZE_MAX >> shift)) usage();
+    return (size_t)size << shift;
+}
+
+static void report_profile() {
+    print_profile(stderr);
+    if (!write_profile_json(PROFILE_JSON_PATH)) {
+        fprintf(stderr, "Could not write profile to \"%s\".\n", PROFILE_JSON_PATH);
+    }
 }
 
 int main(int argc, char *argv[]) {
+    bool profile = false;
+    bool mem_stats = false;
+    bool compile_only = false;
+    bool use_cache = true;
+    bool stream = false;
+    const char* output_path = NULL;
+    size_t max_heap = SIZE_MAX;
+    const char* trace_path = NULL;
+    const char* decode_path = NULL;
+    bool lex_bench = false;
+    bool hash_bench = false;
+    bool rope_bench = false;
+    const char* path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        } else if (strcmp(argv[i], "--mem-stats") == 0) {
+            mem_stats = true;
+        } else if (strcmp(argv[i], "--max-heap") == 0 && i + 1 < argc) {
+            max_heap = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc) {
+            decode_path = argv[++i];
+        } else if (strcmp(argv[i], "--compile-only") == 0) {
+            compile_only = true;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = false;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "--lex-bench") == 0) {
+            lex_bench = true;
+        } else if (strcmp(argv[i], "--hash-bench") == 0) {
+            hash_bench = true;
+        } else if (strcmp(argv[i], "--rope-bench") == 0) {
+            rope_bench = true;
+        } else if ((argv[i][0] == '-' && strcmp(argv[i], "-") != 0) || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+
+    memory_stats.enabled = mem_stats;
+    memory_stats.max_heap = max_heap;
     init_vm();
+    init_profiler(profile);
+    // Scripts exit() on errors, so report from an exit handler.
+    if (profile) atexit(report_profile);
+    if (mem_stats) atexit(report_memory);
+
+    if (output_path != NULL && !compile_only) usage();
+
+    if (decode_path != NULL) {
+        if (path == NULL) usage();
+        decode_trace_file(decode_path, path);
+        free_vm();
+#ifdef MMAP_SOURCE
+        unmap_source();
+#endif /* ifdef MMAP_SOURCE */
+        return 0;
+    }
+
+    if (rope_bench) {
+        if (path != NULL || lex_bench || hash_bench) usage();
+        bench_rope();
+        free_vm();
+        return 0;
+    }
+
+    if (lex_bench || hash_bench) {
+        if (path == NULL || (lex_bench && hash_bench)) usage();
+        ObjSource* source = read_source(path);
+        if (lex_bench) {
+            bench_lexer(source);
+        } else {
+            bench_hash(source);
+        }
+        free_vm();
+#ifdef MMAP_SOURCE
+        unmap_source();
+#endif /* ifdef MMAP_SOURCE */
+        return 0;
+    }
 
-    if (argc == 1) {
+    if (trace_path != NULL) {
+#ifdef DEBUG_TRACE_EXECUTION
+        trace_buffer.path = trace_path;
+        atexit(save_trace);
+#else
+        fprintf(stderr, "Tracing needs a build with DEBUG_TRACE_EXECUTION.\n");
+        exit(64);
+#endif /* ifdef DEBUG_TRACE_EXECUTION */
+    }
+
+    if (compile_only) {
+        if (path == NULL || output_path == NULL || is_bytecode_path(path)) usage();
+        compile_file(path, output_path);
+    } else if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        // Only scripts are cached; REPL lines are too small to be worth it.
+        if (use_cache) bytecode_cache.dir = default_cache_dir();
+        run_file(path, stream);
     }
 
     free_vm();
+    unmap_bytecode();
+#ifdef MMAP_SOURCE
+    unmap_source();
+#endif /* ifdef MMAP_SOURCE */
     return 0;
 }
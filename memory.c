@@ -1,37 +1,595 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "compiler.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size) {
+MemoryStats memory_stats = { .max_heap = SIZE_MAX };
+jmp_buf* heap_limit_handler = NULL;
+
+static const char* category_names[MEM_CATEGORY_COUNT] = {
+    [MEM_CODE]          = "chunk code",
+    [MEM_LINES]         = "line tables",
+    [MEM_CONSTANTS]     = "constant pools",
+    [MEM_TABLES]        = "tables",
+    [MEM_STACK]         = "value stack",
+    [MEM_SCRATCH]       = "scratch",
+    [MEM_TOKENS]        = "token arrays",
+    [MEM_OBJ_STRING]    = "strings",
+    [MEM_OBJ_ROPE]      = "ropes",
+    [MEM_OBJ_SOURCE]    = "sources",
+};
+
+// Unwinds to interpret() with HEAP_LIMIT_EXCEEDED or OUT_OF_MEMORY. Every
+// caller checks before changing anything, so the heap is left as it was.
+static void memory_error(int error, size_t size) {
+    if (heap_limit_handler != NULL) longjmp(*heap_limit_handler, error);
+
+    if (error == HEAP_LIMIT_EXCEEDED) {
+        fprintf(stderr, "Heap limit of %zu bytes exceeded.\n", memory_stats.max_heap);
+    } else {
+        fprintf(stderr, "Out of memory allocating %zu bytes.\n", size);
+    }
+    exit(70);
+}
+
+static void update_peaks(MemoryCategory category) {
+    if (memory_stats.bytes[category] > memory_stats.peak[category]) {
+        memory_stats.peak[category] = memory_stats.bytes[category];
+    }
+    if (memory_stats.bytes_allocated > memory_stats.peak_bytes) {
+        memory_stats.peak_bytes = memory_stats.bytes_allocated;
+    }
+}
+
+// Set while collect_garbage() runs, since shrinking vm.strings allocates.
+static bool collecting = false;
+
+// The room left is worked out without wrapping around, should the total
+// ever already be past the limit.
+static bool over_limit(size_t growth) {
+    return memory_stats.bytes_allocated > memory_stats.max_heap ||
+           growth > memory_stats.max_heap - memory_stats.bytes_allocated;
+}
+
+// Called before every allocation that grows the heap. Collects when the
+// threshold is reached, and again as a last resort before giving up on
+// the heap limit.
+static void make_room(size_t growth) {
+    if (collecting) return;
+
+#ifdef DEBUG_STRESS_GC
+    collect_garbage();
+#else
+    if (memory_stats.bytes_allocated + growth > vm.next_gc) collect_garbage();
+#endif /* ifdef DEBUG_STRESS_GC */
+
+    if (over_limit(growth)) {
+        collect_garbage();
+        if (over_limit(growth)) {
+            memory_error(HEAP_LIMIT_EXCEEDED, growth);
+        }
+    }
+}
+
+// Called before every allocation, resize or free takes effect. Sizes are
+// unsigned, so shrinking wraps around and still adds up.
+static inline void account(MemoryCategory category, size_t old_size, size_t new_size) {
+    if (new_size > old_size) make_room(new_size - old_size);
+    memory_stats.bytes_allocated += new_size - old_size;
+    memory_stats.bytes[category] += new_size - old_size;
+    if (memory_stats.enabled) update_peaks(category);
+}
+
+static void* checked_malloc(size_t size) {
+    void* result = malloc(size);
+    if (result == NULL) memory_error(OUT_OF_MEMORY, size);
+    return result;
+}
+
+// Header in front of each object too big for a size class (every object,
+// without the pool), so the heap walk can find them.
+typedef struct LargeBlock {
+    struct LargeBlock* next;
+    struct LargeBlock* prev;
+} LargeBlock;
+
+#define LARGE_HEADER_SIZE   16
+
+// Kept in allocation order. Sweeping frees oldest first, which lets malloc
+// merge each block with the one before it; newest first had it trim the
+// top of the heap again and again, and sweeps took four times as long.
+static _Thread_local LargeBlock* large_objects;
+static _Thread_local LargeBlock* large_objects_tail;
+
+static void* allocate_large_object(size_t size) {
+    LargeBlock* block = (LargeBlock*)checked_malloc(LARGE_HEADER_SIZE + size);
+    block->next = NULL;
+    block->prev = large_objects_tail;
+    if (block->prev != NULL) {
+        block->prev->next = block;
+    } else {
+        large_objects = block;
+    }
+    large_objects_tail = block;
+    return (char*)block + LARGE_HEADER_SIZE;
+}
+
+static void free_large_object(void* pointer) {
+    LargeBlock* block = (LargeBlock*)((char*)pointer - LARGE_HEADER_SIZE);
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        large_objects = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    } else {
+        large_objects_tail = block->prev;
+    }
+    free(block);
+}
+
+#ifdef POOL_ALLOCATOR
+
+// Requests of up to POOL_MAX_SIZE bytes are rounded up to a multiple of
+// POOL_GRANULE and served from that size class's free list, refilled by
+// carving blocks off SLAB_SIZE slabs. Anything bigger goes to malloc.
+#define POOL_GRANULE    16
+#define POOL_MAX_SIZE   256
+#define POOL_CLASSES    (POOL_MAX_SIZE / POOL_GRANULE)
+#define SLAB_SIZE       (64 * 1024)
+
+// Stored where a live object keeps its type, so walking a slab can tell
+// free blocks from objects.
+#define FREE_BLOCK      0xff
+
+typedef struct FreeBlock {
+    uint8_t type;
+    struct FreeBlock* next;
+} FreeBlock;
+
+// Sits at the start of every slab, padded to POOL_GRANULE so the blocks
+// after it stay aligned. Slabs are aligned to SLAB_SIZE, so any block's
+// slab can be found by masking its address.
+typedef struct Slab {
+    struct Slab* next;
+    // Every block in a slab is from the same size class.
+    uint32_t block_size;
+} Slab;
+
+#define SLAB_OF(pointer) ((Slab*)((uintptr_t)(pointer) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+typedef struct {
+    FreeBlock* free_lists[POOL_CLASSES];
+    // The part of each class's newest slab that has not been handed out.
+    char* carve[POOL_CLASSES];
+    char* carve_end[POOL_CLASSES];
+    Slab* slabs;
+} Pool;
+
+// Buffers behind ALLOCATE/GROW_ARRAY. Their slabs are never released, so
+// a block freed on another thread just joins that thread's free list.
+static _Thread_local Pool buffer_pool;
+// Obj allocations, walked slab by slab and released at once by
+// free_objects().
+static _Thread_local Pool object_pool;
+
+static int size_class(size_t size) {
+    return (int)((size + POOL_GRANULE - 1) / POOL_GRANULE) - 1;
+}
+
+static void* pool_allocate(Pool* pool, size_t size) {
+    int index = size_class(size);
+    FreeBlock* block = pool->free_lists[index];
+    if (block != NULL) {
+        pool->free_lists[index] = block->next;
+        return block;
+    }
+
+    size_t block_size = (size_t)(index + 1) * POOL_GRANULE;
+    if ((size_t)(pool->carve_end[index] - pool->carve[index]) < block_size) {
+        Slab* slab = (Slab*)aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+        if (slab == NULL) memory_error(OUT_OF_MEMORY, SLAB_SIZE);
+        slab->next = pool->slabs;
+        slab->block_size = (uint32_t)block_size;
+        pool->slabs = slab;
+        pool->carve[index] = (char*)slab + POOL_GRANULE;
+        pool->carve_end[index] = (char*)slab + SLAB_SIZE;
+    }
+
+    void* result = pool->carve[index];
+    pool->carve[index] += block_size;
+    return result;
+}
+
+static void pool_free(Pool* pool, void* pointer, size_t size) {
+    int index = size_class(size);
+    FreeBlock* block = (FreeBlock*)pointer;
+    block->type = FREE_BLOCK;
+    block->next = pool->free_lists[index];
+    pool->free_lists[index] = block;
+}
+
+static void free_block(void* pointer, size_t size) {
+    if (size <= POOL_MAX_SIZE) {
+        pool_free(&buffer_pool, pointer, size);
+    } else {
+        free(pointer);
+    }
+}
+
+static void* resize_block(void* pointer, size_t old_size, size_t new_size) {
+    if (new_size == 0) {
+        if (pointer != NULL) free_block(pointer, old_size);
+        return NULL;
+    }
+
+    if (pointer == NULL) {
+        if (new_size <= POOL_MAX_SIZE) return pool_allocate(&buffer_pool, new_size);
+        return checked_malloc(new_size);
+    }
+
+    if (old_size > POOL_MAX_SIZE && new_size > POOL_MAX_SIZE) {
+        void* result = realloc(pointer, new_size);
+        if (result == NULL) memory_error(OUT_OF_MEMORY, new_size);
+        return result;
+    }
+
+    if (old_size <= POOL_MAX_SIZE && new_size <= POOL_MAX_SIZE &&
+        size_class(old_size) == size_class(new_size)) {
+        return pointer;
+    }
+
+    void* result = new_size <= POOL_MAX_SIZE
+        ? pool_allocate(&buffer_pool, new_size)
+        : checked_malloc(new_size);
+    memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+    free_block(pointer, old_size);
+    return result;
+}
+
+static void* allocate_object_block(size_t size) {
+    if (size <= POOL_MAX_SIZE) return pool_allocate(&object_pool, size);
+    return allocate_large_object(size);
+}
+
+static void free_object_block(void* pointer, size_t size) {
+    if (size <= POOL_MAX_SIZE) {
+        pool_free(&object_pool, pointer, size);
+    } else {
+        free_large_object(pointer);
+    }
+}
+
+#else
+
+static void* resize_block(void* pointer, size_t old_size, size_t new_size) {
+    (void)old_size;
     if (new_size == 0) {
         free(pointer);
         return NULL;
     }
 
     void* result = realloc(pointer, new_size);
-    if (result == NULL) exit(1);
+    if (result == NULL) memory_error(OUT_OF_MEMORY, new_size);
     return result;
 }
 
-void free_object(Obj* object) {
+static void* allocate_object_block(size_t size) {
+    return allocate_large_object(size);
+}
+
+static void free_object_block(void* pointer, size_t size) {
+    (void)size;
+    free_large_object(pointer);
+}
+
+#endif /* ifdef POOL_ALLOCATOR */
+
+// Calls `visit` on every live object in address order within each slab,
+// then on the large ones. `visit` may free the object it is given.
+static void walk_heap(void (*visit)(Obj* object)) {
+#ifdef POOL_ALLOCATOR
+    for (Slab* slab = object_pool.slabs; slab != NULL; slab = slab->next) {
+        size_t block_size = slab->block_size;
+        char* block = (char*)slab + POOL_GRANULE;
+        char* end = (char*)slab + SLAB_SIZE;
+        // Only the class's newest slab can be partly carved.
+        char* carve = object_pool.carve[size_class(block_size)];
+        if (carve != NULL && SLAB_OF(carve - 1) == slab) end = carve;
+
+        for (; block + block_size <= end; block += block_size) {
+            Obj* object = (Obj*)block;
+            if (object->type != FREE_BLOCK) visit(object);
+        }
+    }
+#endif /* ifdef POOL_ALLOCATOR */
+
+    LargeBlock* block = large_objects;
+    while (block != NULL) {
+        LargeBlock* next = block->next;
+        visit((Obj*)((char*)block + LARGE_HEADER_SIZE));
+        block = next;
+    }
+}
+
+void* reallocate(MemoryCategory category, void* pointer, size_t old_size, size_t new_size) {
+    account(category, old_size, new_size);
+    return resize_block(pointer, old_size, new_size);
+}
+
+// Counts memory that reallocate() didn't allocate, e.g. because another
+// thread did, for --mem-stats only. It is left out of bytes_allocated, so
+// it neither brings on a collection nor counts against --max-heap.
+void track_memory(MemoryCategory category, size_t old_size, size_t new_size) {
+    memory_stats.bytes[category] += new_size - old_size;
+    if (memory_stats.enabled) update_peaks(category);
+}
+
+void* allocate_object_memory(ObjType type, size_t size) {
+    account(MEM_OBJ_STRING + type, 0, size);
+    return allocate_object_block(size);
+}
+
+void free_object_memory(ObjType type, void* pointer, size_t size) {
+    account(MEM_OBJ_STRING + type, size, 0);
+    free_object_block(pointer, size);
+}
+
+static size_t object_size(Obj* object) {
     switch (object->type) {
         case OBJ_STRING: {
-            ObjString* string = (ObjString*) object;
-            if (string->is_owned) FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
-            break;
+            ObjString* string = (ObjString*)object;
+            if (!string->is_owned) return sizeof(ObjBorrowedString);
+            return sizeof(ObjString) + string->length + 1;
+        }
+        case OBJ_ROPE:
+            return sizeof(ObjRope);
+        case OBJ_SOURCE: {
+            ObjSource* source = (ObjSource*)object;
+            if (!source->is_owned) return sizeof(ObjSource);
+            return sizeof(ObjSource) + source->length + SOURCE_PADDING;
         }
     }
+    return 0;
+}
+
+void free_object(Obj* object) {
+    free_object_memory(object->type, object, object_size(object));
 }
 
 void free_objects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
+#ifdef POOL_ALLOCATOR
+    // Small objects go with their slabs, without visiting them one by one.
+    Slab* slab = object_pool.slabs;
+    while (slab != NULL) {
+        Slab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    memset(&object_pool, 0, sizeof(object_pool));
+
+    LargeBlock* block = large_objects;
+    while (block != NULL) {
+        LargeBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    large_objects = NULL;
+    large_objects_tail = NULL;
+
+    for (int category = MEM_OBJ_STRING; category < MEM_CATEGORY_COUNT; category++) {
+        memory_stats.bytes_allocated -= memory_stats.bytes[category];
+        memory_stats.bytes[category] = 0;
+    }
+#else
+    walk_heap(free_object);
+#endif /* ifdef POOL_ALLOCATOR */
+}
+
+void push_root(Value value) {
+    vm.temp_roots[vm.temp_root_count++] = value;
+}
+
+void pop_root() {
+    vm.temp_root_count--;
+}
+
+typedef struct {
+    MemoryCategory category;
+    void* pointer;
+    size_t size;
+} HeldScratch;
+
+static HeldScratch held_scratch[HELD_SCRATCH_MAX];
+static int held_scratch_count = 0;
+
+// Like push_root() for memory outside the GC heap: if an allocation jumps
+// to heap_limit_handler before release_scratch(), `pointer` is still freed.
+void hold_scratch(MemoryCategory category, void* pointer, size_t size) {
+    HeldScratch* held = &held_scratch[held_scratch_count++];
+    held->category = category;
+    held->pointer = pointer;
+    held->size = size;
+}
+
+void release_scratch() {
+    held_scratch_count--;
+}
+
+void free_held_scratch() {
+    while (held_scratch_count > 0) {
+        HeldScratch* held = &held_scratch[--held_scratch_count];
+        reallocate(held->category, held->pointer, held->size, 0);
+    }
+}
+
+void mark_object(Obj* object) {
+    if (object == NULL || object->is_marked) return;
+
+#ifdef DEBUG_LOG_GC
+    // Printing a rope would flatten it, which allocates.
+    printf("%p mark ", (void*)object);
+    if (object->type == OBJ_STRING) {
+        print_value(OBJ_VAL(object));
+    } else if (object->type == OBJ_ROPE) {
+        printf("<rope %d>", ((ObjRope*)object)->length);
+    } else {
+        printf("<source %d>", ((ObjSource*)object)->length);
+    }
+    printf("\n");
+#endif /* ifdef DEBUG_LOG_GC */
+
+    object->is_marked = true;
+    // A string's only reference is to a source, which has none, so both
+    // are done here and only ropes need to be traced.
+    if (object->type == OBJ_STRING) {
+        ObjString* string = (ObjString*)object;
+        if (!string->is_owned) mark_object((Obj*)((ObjBorrowedString*)string)->source);
+        return;
+    }
+    if (object->type == OBJ_SOURCE) return;
+
+    if (vm.gray_capacity < vm.gray_count + 1) {
+        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+        // Uses the system allocator so growing the gray stack can't
+        // trigger a collection in the middle of this one.
+        Obj** gray_stack = (Obj**)realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+        if (gray_stack == NULL) {
+            fprintf(stderr, "Out of memory while collecting garbage.\n");
+            exit(70);
+        }
+        vm.gray_stack = gray_stack;
+    }
+    vm.gray_stack[vm.gray_count++] = object;
+}
+
+void mark_value(Value value) {
+    if (IS_OBJ(value)) mark_object(AS_OBJ(value));
+}
+
+static void mark_array(ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        mark_value(array->values[i]);
+    }
+}
+
+static void blacken_object(Obj* object) {
+    switch (object->type) {
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            mark_object(rope->left);
+            mark_object(rope->right);
+            mark_object((Obj*)rope->flat);
+            break;
+        }
+        case OBJ_STRING:
+        case OBJ_SOURCE:
+            break;
+    }
+}
+
+static void mark_roots() {
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+        mark_value(*slot);
+    }
+    for (int i = 0; i < vm.temp_root_count; i++) {
+        mark_value(vm.temp_roots[i]);
+    }
+    if (vm.chunk != NULL) {
+        mark_array(&vm.chunk->constants);
+        mark_object((Obj*)vm.chunk->source);
+    }
+    mark_compiler_roots();
+}
+
+static void trace_references() {
+    while (vm.gray_count > 0) {
+        blacken_object(vm.gray_stack[--vm.gray_count]);
+    }
+}
+
+static void sweep_object(Obj* object) {
+    if (object->is_marked) {
+        object->is_marked = false;
+    } else {
         free_object(object);
-        object = next;
     }
 }
+
+static void sweep() {
+    walk_heap(sweep_object);
+}
+
+static double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void collect_garbage() {
+    collecting = true;
+    double start = seconds_now();
+    size_t before = memory_stats.bytes_allocated;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif /* ifdef DEBUG_LOG_GC */
+
+    mark_roots();
+    trace_references();
+    // vm.strings is weak: drop whatever the mark phase didn't reach before
+    // sweep() frees it, then give back the table space if many died.
+    intern_remove_white(&vm.strings);
+    sweep();
+    intern_shrink(&vm.strings);
+
+    vm.next_gc = memory_stats.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (vm.next_gc < GC_INITIAL_THRESHOLD) vm.next_gc = GC_INITIAL_THRESHOLD;
+
+    double pause = seconds_now() - start;
+    memory_stats.collections++;
+    memory_stats.bytes_collected += before - memory_stats.bytes_allocated;
+    memory_stats.total_pause += pause;
+    if (pause > memory_stats.max_pause) memory_stats.max_pause = pause;
+    collecting = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu in %.3f ms\n",
+           before - memory_stats.bytes_allocated, before,
+           memory_stats.bytes_allocated, vm.next_gc, pause * 1e3);
+#endif /* ifdef DEBUG_LOG_GC */
+}
+
+void print_memory_stats(FILE* out) {
+    fprintf(out, "%-16s %12s %12s\n", "memory", "current", "peak");
+    for (int category = 0; category < MEM_CATEGORY_COUNT; category++) {
+        if (category == MEM_TOKENS) continue;
+        fprintf(out, "%-16s %12zu %12zu\n", category_names[category],
+                memory_stats.bytes[category], memory_stats.peak[category]);
+    }
+    fprintf(out, "%-16s %12zu %12zu\n", "total",
+            memory_stats.bytes_allocated, memory_stats.peak_bytes);
+    // Tracked, but not part of the heap.
+    fprintf(out, "%-16s %12zu %12zu\n", category_names[MEM_TOKENS],
+            memory_stats.bytes[MEM_TOKENS], memory_stats.peak[MEM_TOKENS]);
+
+    if (memory_stats.collections == 0) return;
+    fprintf(out, "gc: %d collections freed %zu bytes; pause total %.3f ms, "
+                 "mean %.3f ms, max %.3f ms\n",
+            memory_stats.collections, memory_stats.bytes_collected,
+            memory_stats.total_pause * 1e3,
+            memory_stats.total_pause * 1e3 / memory_stats.collections,
+            memory_stats.max_pause * 1e3);
+}
@@ -3,22 +3,91 @@
 
 #include "common.h"
 #include "object.h"
+#include <setjmp.h>
+#include <stdio.h>
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+// What an allocation is for, so --mem-stats can break usage down.
+typedef enum {
+    MEM_CODE,
+    MEM_LINES,
+    MEM_CONSTANTS,
+    MEM_TABLES,
+    MEM_STACK,
+    MEM_SCRATCH,
+    MEM_TOKENS,
+    // One per ObjType, in the same order.
+    MEM_OBJ_STRING,
+    MEM_OBJ_ROPE,
+    MEM_OBJ_SOURCE,
+    MEM_CATEGORY_COUNT,
+} MemoryCategory;
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0);
+// The first collection happens once this much is allocated; after each
+// one the threshold becomes GC_HEAP_GROW_FACTOR times what survived.
+#define GC_INITIAL_THRESHOLD    (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR     2
+
+// Passed to longjmp() through heap_limit_handler.
+#define HEAP_LIMIT_EXCEEDED 1
+#define OUT_OF_MEMORY       2
+
+typedef struct {
+    // Kept up to date on every allocation, in total and per category.
+    size_t bytes_allocated;
+    // reallocate() refuses to grow the heap past this; SIZE_MAX by default.
+    size_t max_heap;
+    // The peaks are only tracked when this is set.
+    bool enabled;
+    size_t peak_bytes;
+    size_t bytes[MEM_CATEGORY_COUNT];
+    size_t peak[MEM_CATEGORY_COUNT];
+
+    // Collector pauses, always recorded.
+    int collections;
+    size_t bytes_collected;
+    double total_pause;
+    double max_pause;
+} MemoryStats;
+
+extern MemoryStats memory_stats;
+
+// Where reallocate() jumps when an allocation would pass max_heap. With no
+// handler installed the process exits instead.
+extern jmp_buf* heap_limit_handler;
+
+// Buffers only a C local points to while more is allocated, which the
+// handler frees with free_held_scratch(). Never more than a few at once.
+#define HELD_SCRATCH_MAX 8
+
+#define ALLOCATE(category, type, count) \
+    (type*)reallocate(category, NULL, 0, sizeof(type) * (count))
+
+#define FREE(category, type, pointer) reallocate(category, pointer, sizeof(type), 0);
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, old_count, new_count) \
-    (type*) reallocate(pointer, sizeof(type) * (old_count), sizeof(type) * (new_count))
+#define GROW_ARRAY(category, type, pointer, old_count, new_count) \
+    (type*) reallocate(category, pointer, sizeof(type) * (old_count), sizeof(type) * (new_count))
 
-#define FREE_ARRAY(type, pointer, old_count) \
-    reallocate(pointer, sizeof(type) * (old_count), 0)
+#define FREE_ARRAY(category, type, pointer, old_count) \
+    reallocate(category, pointer, sizeof(type) * (old_count), 0)
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size);
+void* reallocate(MemoryCategory category, void* pointer, size_t old_size, size_t new_size);
+void track_memory(MemoryCategory category, size_t old_size, size_t new_size);
+void* allocate_object_memory(ObjType type, size_t size);
+void free_object_memory(ObjType type, void* pointer, size_t size);
+void free_object(Obj* object);
 void free_objects();
+void print_memory_stats(FILE* out);
+
+void push_root(Value value);
+void pop_root();
+void hold_scratch(MemoryCategory category, void* pointer, size_t size);
+void release_scratch();
+void free_held_scratch();
+void mark_object(Obj* object);
+void mark_value(Value value);
+void collect_garbage();
 
 #endif // !clox_memory_h
@@ -3,8 +3,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "intern.h"
 #include "memory.h"
-#include "table.h"
 #include "value.h"
 #include "vm.h"
 #include "object.h"
@@ -16,24 +16,98 @@
     (ObjString*)allocate_object(sizeof(ObjString) + (length) * sizeof(char), OBJ_STRING)
 
 static Obj* allocate_object(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = (Obj*)allocate_object_memory(type, size);
     object->type = type;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->is_marked = false;
     return object;
 }
 
-static ObjString* allocate_string(const char* chars, int length, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ_STRING(length + 1);
+// Allocates a string with room for `length` characters plus the
+// terminator. Callers fill in `chars` directly, so every string's
+// characters are copied exactly once.
+ObjString* allocate_string(int length) {
+    ObjString* string = ALLOCATE_OBJ_STRING(length + 1);
     string->length = length;
-    strncpy(string->chars, chars, length);
+    string->is_owned = true;
+    string->is_interned = false;
+    string->hash = 0;
+    string->chars = (char*)(string + 1);
     string->chars[length] = '\0';
-    string->hash = hash;
-    table_set(&vm.strings, &OBJ_VAL(string), NIL_VAL);
     return string;
 }
 
-static uint32_t hash_string(const char* key, int length) {
+#ifdef WORD_HASH
+
+#define HASH_SECRET0 0xa0761d6478bd642full
+#define HASH_SECRET1 0xe7037ed1a0b428dbull
+#define HASH_SEED    0x8ebc6af09c88c6e3ull
+
+// Multiplies into 128 bits and folds the halves together.
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t a_high = a >> 32, a_low = (uint32_t)a;
+    uint64_t b_high = b >> 32, b_low = (uint32_t)b;
+    uint64_t high = a_high * b_high, low = a_low * b_low;
+    uint64_t cross1 = a_high * b_low, cross2 = a_low * b_high;
+    uint64_t middle = (low >> 32) + (uint32_t)cross1 + (uint32_t)cross2;
+    low = (uint32_t)low | (middle << 32);
+    high += (cross1 >> 32) + (cross2 >> 32) + (middle >> 32);
+    return low ^ high;
+#endif
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// wyhash's structure: 16 bytes per round, with short keys read as
+// overlapping words so no byte loop is needed at all.
+static uint32_t hash_chars(const char* key, int length) {
+    const uint8_t* p = (const uint8_t*)key;
+    size_t remaining = (size_t)length;
+    uint64_t seed = HASH_SEED ^ hash_mix(HASH_SEED ^ HASH_SECRET0, HASH_SECRET1);
+    uint64_t a, b;
+
+    if (remaining <= 16) {
+        if (remaining >= 4) {
+            size_t step = (remaining >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + step);
+            b = (read32(p + remaining - 4) << 32) | read32(p + remaining - 4 - step);
+        } else if (remaining > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) | p[remaining - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        while (remaining > 16) {
+            seed = hash_mix(read64(p) ^ HASH_SECRET1, read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+
+    uint64_t hash = hash_mix(a ^ HASH_SECRET1, b ^ seed);
+    hash = hash_mix(hash ^ HASH_SECRET0 ^ (uint64_t)length, HASH_SECRET1);
+    return (uint32_t)hash;
+}
+
+#else
+
+static uint32_t hash_chars(const char* key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
         hash ^= (uint32_t) key[i];
@@ -42,37 +116,179 @@ static uint32_t hash_string(const char* key, int length) {
     return hash;
 }
 
-ObjString* take_string(char* chars, int length) {
-    uint32_t hash = hash_string(chars, length);
+#endif /* ifdef WORD_HASH */
 
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+// Hashes on first use. 0 marks a hash that has not been computed, so a
+// real hash of 0 is stored as 1.
+uint32_t string_hash(ObjString* string) {
+    if (string->hash == 0) {
+        uint32_t hash = hash_chars(string->chars, string->length);
+        string->hash = hash == 0 ? 1 : hash;
     }
+    return string->hash;
+}
 
-    ObjString* string = allocate_string(chars, length, hash);
-    string->is_owned = true;
+// Returns the canonical copy of `string`, making `string` itself canonical
+// if there is none yet.
+ObjString* intern_string(ObjString* string) {
+    if (string->is_interned) return string;
+
+    uint32_t hash = string_hash(string);
+    ObjString* interned = intern_find(&vm.strings, string->chars, string->length, hash);
+    if (interned != NULL) return interned;
+
+    string->is_interned = true;
+    // Growing the set can collect, and the caller may hold the only
+    // reference to `string`.
+    push_root(OBJ_VAL(string));
+    intern_add(&vm.strings, string);
+    pop_root();
     return string;
 }
 
 ObjString* copy_string(const char* chars, int length) {
-    uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
-    /*char* heap_chars = ALLOCATE(char, length + 1);*/
-    /*memcpy(heap_chars, chars, length);*/
-    /*heap_chars[length] = '\0';*/
-    /*return allocate_string(heap_chars, length);*/
-    ObjString* string = allocate_string(chars, length, hash);
+    ObjString* string = allocate_string(length);
+    memcpy(string->chars, chars, length);
+    return string;
+}
+
+// Costs a fixed-size object however long the literal is. The caller must
+// keep `source` reachable until the string is.
+ObjString* borrow_string(ObjSource* source, const char* chars, int length) {
+    ObjBorrowedString* borrowed = ALLOCATE_OBJ(ObjBorrowedString, OBJ_STRING);
+    ObjString* string = &borrowed->string;
+    string->length = length;
     string->is_owned = false;
+    string->is_interned = false;
+    string->hash = 0;
+    string->chars = (char*)chars;
+    borrowed->source = source;
     return string;
 }
 
+ObjSource* allocate_source(int length) {
+    ObjSource* source = (ObjSource*)allocate_object(sizeof(ObjSource) + length + SOURCE_PADDING,
+                                                    OBJ_SOURCE);
+    source->is_owned = true;
+    source->length = length;
+    source->chars = (char*)(source + 1);
+    memset(source->chars + length, 0, SOURCE_PADDING);
+    return source;
+}
+
+ObjSource* copy_source(const char* chars, int length) {
+    ObjSource* source = allocate_source(length);
+    memcpy(source->chars, chars, length);
+    return source;
+}
+
+// `chars` must be followed by SOURCE_PADDING zero bytes.
+ObjSource* borrow_source(char* chars, int length) {
+    ObjSource* source = ALLOCATE_OBJ(ObjSource, OBJ_SOURCE);
+    source->is_owned = false;
+    source->length = length;
+    source->chars = chars;
+    return source;
+}
+
+static int string_length(Obj* object) {
+    if (object->type == OBJ_ROPE) return ((ObjRope*)object)->length;
+    return ((ObjString*)object)->length;
+}
+
+// Flattened ropes are replaced by their string so new ropes stay shallow.
+static Obj* rope_child(Obj* object) {
+    if (object->type == OBJ_ROPE && ((ObjRope*)object)->flat != NULL) {
+        return (Obj*)((ObjRope*)object)->flat;
+    }
+    return object;
+}
+
+Value concatenate_strings(Value a, Value b) {
+    Obj* left = rope_child(AS_OBJ(a));
+    Obj* right = rope_child(AS_OBJ(b));
+    int left_length = string_length(left);
+    int right_length = string_length(right);
+    if (left_length == 0) return OBJ_VAL(right);
+    if (right_length == 0) return OBJ_VAL(left);
+
+    int length = left_length + right_length;
+    if (length < ROPE_MIN_LENGTH) {
+        // Both sides are flat: a rope is never shorter than the threshold.
+        ObjString* x = (ObjString*)left;
+        ObjString* y = (ObjString*)right;
+        ObjString* string = allocate_string(length);
+        memcpy(string->chars, x->chars, x->length);
+        memcpy(string->chars + x->length, y->chars, y->length);
+        return OBJ_VAL(string);
+    }
+
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return OBJ_VAL(rope);
+}
+
+ObjString* flatten_rope(ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    ObjString* flat = allocate_string(rope->length);
+    // Growing `pending` can collect, and nothing points at `flat` yet.
+    push_root(OBJ_VAL(flat));
+    char* chars = flat->chars;
+    int end = rope->length;
+
+    // Copies right to left, so the left-leaning trees that repeated
+    // appends build only keep one left child pending at a time.
+    Obj** pending = NULL;
+    int pending_count = 0;
+    int pending_capacity = 0;
+    Obj* node = (Obj*)rope;
+    for (;;) {
+        node = rope_child(node);
+        if (node->type == OBJ_ROPE) {
+            if (pending_capacity < pending_count + 1) {
+                int old_capacity = pending_capacity;
+                pending_capacity = GROW_CAPACITY(old_capacity);
+                // The limit is checked before `pending` is touched.
+                hold_scratch(MEM_SCRATCH, pending, sizeof(Obj*) * old_capacity);
+                pending = GROW_ARRAY(MEM_SCRATCH, Obj*, pending, old_capacity, pending_capacity);
+                release_scratch();
+            }
+            pending[pending_count++] = ((ObjRope*)node)->left;
+            node = ((ObjRope*)node)->right;
+            continue;
+        }
+
+        ObjString* string = (ObjString*)node;
+        end -= string->length;
+        memcpy(chars + end, string->chars, string->length);
+        if (pending_count == 0) break;
+        node = pending[--pending_count];
+    }
+    FREE_ARRAY(MEM_SCRATCH, Obj*, pending, pending_capacity);
+    pop_root();
+
+    rope->flat = flat;
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
 void print_object(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            printf("%.*s", AS_STRING(value)->length, AS_CSTRING(value));
+            break;
+        case OBJ_ROPE: {
+            ObjString* flat = flatten_rope(AS_ROPE(value));
+            printf("%.*s", flat->length, flat->chars);
+            break;
+        }
+        case OBJ_SOURCE:
+            printf("<source>");
             break;
     }
 }
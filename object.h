@@ -8,30 +8,90 @@
 #define OBJ_TYPE(value)         (AS_OBJ(value)->type)
 
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)          isObjType(value, OBJ_ROPE)
+// Either representation of a Lox string.
+#define IS_ANY_STRING(value)    (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)        (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value)          ((ObjRope*)AS_OBJ(value))
+
+// Concatenations shorter than this are copied straight into a flat string.
+#define ROPE_MIN_LENGTH 64
 
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
+    OBJ_SOURCE,
 } ObjType;
 
+// Objects are found by walking the heap's slabs, so the header needs no
+// list pointer and fits in two bytes.
 struct Obj {
-    ObjType type;
-    struct Obj* next;
+    // An ObjType.
+    uint8_t type;
+    bool is_marked;
 };
 
 struct ObjString {
     Obj obj;
     int length;
-    // used to know whether to free the `chars[]` upon freeing `ObjString`
+    // Owned strings keep their characters right after the struct. The rest
+    // are ObjBorrowedStrings pointing into a source buffer, and are not
+    // null-terminated.
     bool is_owned;
+    // Whether this is the copy in vm.strings. Strings are only interned
+    // once they are used as a table key or a constant.
+    bool is_interned;
+    // Computed lazily by string_hash(); 0 until then.
     uint32_t hash;
-    char chars[];
+    char* chars;
 };
 
-ObjString* take_string(char* chars, int length);
+// Zero bytes after a source's text, counting the terminator. The
+// scanner's vector loads may read this far past any character.
+#define SOURCE_PADDING 16
+
+// A script's text, followed by SOURCE_PADDING zero bytes. Chunks compiled
+// from it and the string literals borrowed from it keep it alive.
+struct ObjSource {
+    Obj obj;
+    // Whether `chars` follows the struct. Otherwise it belongs to the
+    // embedder, e.g. a mapped file, and must outlive the VM and be padded
+    // the same way.
+    bool is_owned;
+    int length;
+    char* chars;
+};
+
+// A string literal that refers into the source instead of copying it.
+typedef struct {
+    ObjString string;
+    ObjSource* source;
+} ObjBorrowedString;
+
+// A concatenation whose characters have not been copied yet. `left` and
+// `right` are each an ObjString or another ObjRope. The first time the
+// characters are needed they are copied into `flat` and the children are
+// dropped.
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left;
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
+ObjString* allocate_string(int length);
 ObjString* copy_string(const char* chars, int length);
+ObjString* borrow_string(ObjSource* source, const char* chars, int length);
+ObjSource* allocate_source(int length);
+ObjSource* copy_source(const char* chars, int length);
+ObjSource* borrow_source(char* chars, int length);
+uint32_t string_hash(ObjString* string);
+ObjString* intern_string(ObjString* string);
+Value concatenate_strings(Value a, Value b);
+ObjString* flatten_rope(ObjRope* rope);
 void print_object(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
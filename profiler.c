@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profiler.h"
+#include "chunk.h"
+#include "debug.h"
+
+Profiler profiler;
+
+static uint64_t read_cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    // No portable cycle counter; nanoseconds keep the relative costs.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void init_profiler(bool enabled) {
+    memset(&profiler, 0, sizeof(profiler));
+    profiler.enabled = enabled;
+    profiler.last_instruction = -1;
+}
+
+void profile_instruction(uint8_t instruction) {
+    uint64_t now = read_cycle_counter();
+    if (profiler.last_instruction != -1) {
+        profiler.cycles[profiler.last_instruction] += now - profiler.last_stamp;
+    }
+    profiler.counts[instruction]++;
+    profiler.last_instruction = instruction;
+    profiler.last_stamp = now;
+}
+
+// Charges the last instruction run and stops timing, e.g. once run() returns.
+void end_profile_sample() {
+    if (profiler.last_instruction == -1) return;
+    profiler.cycles[profiler.last_instruction] +=
+        read_cycle_counter() - profiler.last_stamp;
+    profiler.last_instruction = -1;
+}
+
+static int compare_by_cycles(const void* a, const void* b) {
+    uint8_t x = *(const uint8_t*)a;
+    uint8_t y = *(const uint8_t*)b;
+    if (profiler.cycles[x] != profiler.cycles[y]) {
+        return profiler.cycles[x] < profiler.cycles[y] ? 1 : -1;
+    }
+    if (profiler.counts[x] != profiler.counts[y]) {
+        return profiler.counts[x] < profiler.counts[y] ? 1 : -1;
+    }
+    return x - y;
+}
+
+// Fills `order` with the executed opcodes, most expensive first.
+static int sorted_opcodes(uint8_t* order, uint64_t* total_count,
+                          uint64_t* total_cycles) {
+    int count = 0;
+    *total_count = 0;
+    *total_cycles = 0;
+    for (int i = 0; i <= UINT8_MAX; i++) {
+        if (profiler.counts[i] == 0) continue;
+        order[count++] = (uint8_t)i;
+        *total_count += profiler.counts[i];
+        *total_cycles += profiler.cycles[i];
+    }
+    qsort(order, count, sizeof(uint8_t), compare_by_cycles);
+    return count;
+}
+
+void print_profile(FILE* out) {
+    uint8_t order[UINT8_MAX + 1];
+    uint64_t total_count, total_cycles;
+    int count = sorted_opcodes(order, &total_count, &total_cycles);
+
+    fprintf(out, "== profile ==\n");
+    fprintf(out, "%-18s %14s %7s %16s %7s %10s\n",
+            "opcode", "count", "count%", "cycles", "cycles%", "cyc/op");
+    for (int i = 0; i < count; i++) {
+        uint8_t op = order[i];
+        fprintf(out, "%-18s %14llu %6.2f%% %16llu %6.2f%% %10.1f\n",
+                opcode_name(op),
+                (unsigned long long)profiler.counts[op],
+                100.0 * profiler.counts[op] / total_count,
+                (unsigned long long)profiler.cycles[op],
+                total_cycles == 0 ? 0.0 : 100.0 * profiler.cycles[op] / total_cycles,
+                (double)profiler.cycles[op] / profiler.counts[op]);
+    }
+    fprintf(out, "%-18s %14llu %7s %16llu\n", "total",
+            (unsigned long long)total_count, "",
+            (unsigned long long)total_cycles);
+}
+
+bool write_profile_json(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    uint8_t order[UINT8_MAX + 1];
+    uint64_t total_count, total_cycles;
+    int count = sorted_opcodes(order, &total_count, &total_cycles);
+
+    fprintf(file, "{\n  \"instructions\": %llu,\n  \"cycles\": %llu,\n  \"opcodes\": [",
+            (unsigned long long)total_count, (unsigned long long)total_cycles);
+    for (int i = 0; i < count; i++) {
+        uint8_t op = order[i];
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"opcode\": %d, "
+                      "\"count\": %llu, \"cycles\": %llu}",
+                i == 0 ? "" : ",", opcode_name(op), op,
+                (unsigned long long)profiler.counts[op],
+                (unsigned long long)profiler.cycles[op]);
+    }
+    fprintf(file, "\n  ]\n}\n");
+
+    return fclose(file) == 0;
+}
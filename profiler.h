@@ -0,0 +1,27 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "common.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Per-opcode execution counts and cycle totals, collected by run() when
+// `enabled` is set. Each instruction is charged the cycles until the next
+// one starts.
+typedef struct {
+    bool enabled;
+    uint64_t counts[UINT8_MAX + 1];
+    uint64_t cycles[UINT8_MAX + 1];
+    int last_instruction;
+    uint64_t last_stamp;
+} Profiler;
+
+extern Profiler profiler;
+
+void init_profiler(bool enabled);
+void profile_instruction(uint8_t instruction);
+void end_profile_sample();
+void print_profile(FILE* out);
+bool write_profile_json(const char* path);
+
+#endif // !clox_profiler_h
@@ -1,32 +1,186 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
+#include "object.h"
 #include "scanner.h"
 
+#ifdef SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
 typedef struct {
     const char* start;
     const char* current;
     int line;
 } Scanner;
 
-Scanner scanner;
+// One per thread, so pieces of a source can be scanned in parallel.
+static _Thread_local Scanner scanner;
 
 void init_scanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    init_scanner_at(source, 1);
+}
+
+void init_scanner_at(const char* start, int line) {
+    scanner.start = start;
+    scanner.current = start;
+    scanner.line = line;
 }
 
+// What each byte can be part of. '\n' is left out of CHAR_SPACE because
+// it also has to be counted.
+#define CHAR_ALPHA  0x01
+#define CHAR_DIGIT  0x02
+#define CHAR_SPACE  0x04
+
+static const uint8_t char_class[256] = {
+    [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+    ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT, ['3'] = CHAR_DIGIT, ['4'] = CHAR_DIGIT,
+    ['5'] = CHAR_DIGIT, ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT, ['8'] = CHAR_DIGIT, ['9'] = CHAR_DIGIT,
+    ['A'] = CHAR_ALPHA, ['B'] = CHAR_ALPHA, ['C'] = CHAR_ALPHA, ['D'] = CHAR_ALPHA, ['E'] = CHAR_ALPHA,
+    ['F'] = CHAR_ALPHA, ['G'] = CHAR_ALPHA, ['H'] = CHAR_ALPHA, ['I'] = CHAR_ALPHA, ['J'] = CHAR_ALPHA,
+    ['K'] = CHAR_ALPHA, ['L'] = CHAR_ALPHA, ['M'] = CHAR_ALPHA, ['N'] = CHAR_ALPHA, ['O'] = CHAR_ALPHA,
+    ['P'] = CHAR_ALPHA, ['Q'] = CHAR_ALPHA, ['R'] = CHAR_ALPHA, ['S'] = CHAR_ALPHA, ['T'] = CHAR_ALPHA,
+    ['U'] = CHAR_ALPHA, ['V'] = CHAR_ALPHA, ['W'] = CHAR_ALPHA, ['X'] = CHAR_ALPHA, ['Y'] = CHAR_ALPHA,
+    ['Z'] = CHAR_ALPHA,
+    ['a'] = CHAR_ALPHA, ['b'] = CHAR_ALPHA, ['c'] = CHAR_ALPHA, ['d'] = CHAR_ALPHA, ['e'] = CHAR_ALPHA,
+    ['f'] = CHAR_ALPHA, ['g'] = CHAR_ALPHA, ['h'] = CHAR_ALPHA, ['i'] = CHAR_ALPHA, ['j'] = CHAR_ALPHA,
+    ['k'] = CHAR_ALPHA, ['l'] = CHAR_ALPHA, ['m'] = CHAR_ALPHA, ['n'] = CHAR_ALPHA, ['o'] = CHAR_ALPHA,
+    ['p'] = CHAR_ALPHA, ['q'] = CHAR_ALPHA, ['r'] = CHAR_ALPHA, ['s'] = CHAR_ALPHA, ['t'] = CHAR_ALPHA,
+    ['u'] = CHAR_ALPHA, ['v'] = CHAR_ALPHA, ['w'] = CHAR_ALPHA, ['x'] = CHAR_ALPHA, ['y'] = CHAR_ALPHA,
+    ['z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA,
+};
+
 static bool is_alpha(char c) {
-    return ('a' <= c && c <= 'z') ||
-           ('A' <= c && c <= 'Z') ||
-            c == '_';
+    return char_class[(uint8_t)c] & CHAR_ALPHA;
 }
 
 static bool is_digit(char c) {
-    return '0' <= c && c <= '9';
+    return char_class[(uint8_t)c] & CHAR_DIGIT;
+}
+
+// The kernels below each skip a run of characters and return where it
+// ends. They never pass the terminator, and the SSE2 versions rely on the
+// SOURCE_PADDING zero bytes after it to load 16 bytes from any position.
+
+#ifdef SIMD_SSE2
+
+#define BYTES(c) _mm_set1_epi8((char)(c))
+
+// Newlines among the first `count` bytes of a 16-byte block's mask.
+static int count_lines(int newlines, int count) {
+    return __builtin_popcount(newlines & ((1u << count) - 1));
+}
+
+// Stops at anything but letters, digits and '_'.
+static const char* skip_identifier(const char* p) {
+    for (;; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        // Setting bit 5 folds upper case onto lower case and leaves no
+        // other byte inside 'a'..'z'.
+        __m128i folded = _mm_or_si128(chunk, BYTES(0x20));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, BYTES('a' - 1)),
+                                      _mm_cmplt_epi8(folded, BYTES('z' + 1)));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, BYTES('0' - 1)),
+                                      _mm_cmplt_epi8(chunk, BYTES('9' + 1)));
+        __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit),
+                                    _mm_cmpeq_epi8(chunk, BYTES('_')));
+        int stop = ~_mm_movemask_epi8(word) & 0xffff;
+        if (stop != 0) return p + __builtin_ctz(stop);
+    }
+}
+
+static bool is_blank(char c) {
+    return c == '\n' || (char_class[(uint8_t)c] & CHAR_SPACE);
+}
+
+// Stops at anything but spaces, tabs, carriage returns and newlines.
+static const char* skip_blanks(const char* p, int* line) {
+    // Most gaps between tokens are empty or a single space, which a byte
+    // or two settle sooner than a block.
+    if (!is_blank(p[0])) return p;
+    if (p[0] == ' ' && !is_blank(p[1])) return p + 1;
+
+    for (;; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i newline = _mm_cmpeq_epi8(chunk, BYTES('\n'));
+        __m128i blank = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, BYTES(' ')), newline),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, BYTES('\t')), _mm_cmpeq_epi8(chunk, BYTES('\r'))));
+        int newlines = _mm_movemask_epi8(newline);
+        int stop = ~_mm_movemask_epi8(blank) & 0xffff;
+        if (stop != 0) {
+            int count = __builtin_ctz(stop);
+            *line += count_lines(newlines, count);
+            return p + count;
+        }
+        *line += __builtin_popcount(newlines);
+    }
+}
+
+// Stops at a newline or the terminator.
+static const char* skip_comment(const char* p) {
+    for (;; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i end = _mm_or_si128(_mm_cmpeq_epi8(chunk, BYTES('\n')),
+                                   _mm_cmpeq_epi8(chunk, _mm_setzero_si128()));
+        int stop = _mm_movemask_epi8(end);
+        if (stop != 0) return p + __builtin_ctz(stop);
+    }
+}
+
+// Stops at a '"' or the terminator, counting the newlines before it.
+static const char* skip_string_body(const char* p, int* line) {
+    for (;; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i end = _mm_or_si128(_mm_cmpeq_epi8(chunk, BYTES('"')),
+                                   _mm_cmpeq_epi8(chunk, _mm_setzero_si128()));
+        int newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, BYTES('\n')));
+        int stop = _mm_movemask_epi8(end);
+        if (stop != 0) {
+            int count = __builtin_ctz(stop);
+            *line += count_lines(newlines, count);
+            return p + count;
+        }
+        *line += __builtin_popcount(newlines);
+    }
+}
+
+#undef BYTES
+
+#else
+
+static const char* skip_identifier(const char* p) {
+    while (char_class[(uint8_t)*p] & (CHAR_ALPHA | CHAR_DIGIT)) p++;
+    return p;
+}
+
+static const char* skip_blanks(const char* p, int* line) {
+    for (;; p++) {
+        if (*p == '\n') {
+            (*line)++;
+        } else if (!(char_class[(uint8_t)*p] & CHAR_SPACE)) {
+            return p;
+        }
+    }
+}
+
+static const char* skip_comment(const char* p) {
+    while (*p != '\n' && *p != '\0') p++;
+    return p;
 }
 
+static const char* skip_string_body(const char* p, int* line) {
+    for (; *p != '"' && *p != '\0'; p++) {
+        if (*p == '\n') (*line)++;
+    }
+    return p;
+}
+
+#endif /* ifdef SIMD_SSE2 */
+
 static bool is_at_end() {
     return *scanner.current == '\0';
 }
@@ -66,30 +220,17 @@ static char peek_next() {
 
 static void skip_whitespace() {
     for (;;) {
-        char c = peek();
-        switch (c) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance();
-                break;
-            case '\n':
-                scanner.line++;
-                advance();
-                break;
-            case '/':
-                if (peek_next() == '/') {
-                    while (peek() != '\n' && !is_at_end()) advance();
-                } else {
-                    return;
-                }
-                break;
-            default:
-                return;
-        }
+        scanner.current = skip_blanks(scanner.current, &scanner.line);
+        if (peek() != '/' || peek_next() != '/') return;
+        scanner.current = skip_comment(scanner.current + 2);
     }
 }
 
+const char* skip_to_token() {
+    skip_whitespace();
+    return scanner.current;
+}
+
 static TokenType check_keyword(int start, int length, const char* rest, TokenType type) {
     if (
         scanner.current - scanner.start == start + length &&
@@ -136,7 +277,7 @@ static TokenType identifier_type() {
 }
 
 static Token identifier() {
-    while(is_alpha(peek()) || is_digit(peek())) advance();
+    scanner.current = skip_identifier(scanner.current);
     return make_token(identifier_type());
 }
 
@@ -152,10 +293,7 @@ static Token number() {
 }
 
 static Token string() {
-    while(peek() != '"' && !is_at_end()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
-    }
+    scanner.current = skip_string_body(scanner.current, &scanner.line);
 
     if (is_at_end()) return error_token("Unterminated string.");
 
@@ -36,9 +36,39 @@ typedef struct {
     int line;
 } Token;
 
+// Where a pass over the raw bytes of a source stands, as far as telling
+// where strings and comments open and close is concerned. Used to split
+// sources at places no token straddles without scanning them.
+typedef enum {
+    LEX_OUTSIDE,
+    LEX_IN_STRING,
+    LEX_IN_COMMENT,
+} LexState;
+
+// The state after the byte at `p`. Reads `p[1]` to spot "//".
+static inline LexState lex_step(LexState state, const char* p) {
+    switch (*p) {
+        case '"':
+            if (state == LEX_OUTSIDE) return LEX_IN_STRING;
+            if (state == LEX_IN_STRING) return LEX_OUTSIDE;
+            return state;
+        case '/':
+            return state == LEX_OUTSIDE && p[1] == '/' ? LEX_IN_COMMENT : state;
+        case '\n':
+            return state == LEX_IN_COMMENT ? LEX_OUTSIDE : state;
+        default:
+            return state;
+    }
+}
+
 Token scan_token();
 
 
 void init_scanner(const char* source);
+// Scans from `start`, which must not be inside a token, counting lines
+// from `line`.
+void init_scanner_at(const char* start, int line);
+// Skips whitespace and comments and returns where the next token starts.
+const char* skip_to_token();
 
 #endif // !clox_scanner_h
@@ -0,0 +1,133 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "stream.h"
+
+void init_source_stream(SourceStream* stream, FILE* file) {
+    stream->file = file;
+    stream->window = NULL;
+    stream->token_window = NULL;
+    stream->previous_window = NULL;
+    stream->filled = 0;
+    stream->cut = 0;
+    stream->cut_byte = '\0';
+    stream->line = 1;
+    stream->cut_line = 1;
+    stream->at_eof = false;
+    stream->failed = false;
+}
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Picks the last place in the window that is just past whitespace outside
+// strings and comments. Every window starts at such a place, so the pass
+// starts outside too. 0 if there is none.
+static void find_cut(SourceStream* stream) {
+    const char* chars = stream->window->chars;
+    LexState state = LEX_OUTSIDE;
+    int newlines = 0;
+    stream->cut = 0;
+    stream->cut_line = stream->line;
+
+    for (int i = 0; i < stream->filled; i++) {
+        state = lex_step(state, &chars[i]);
+        if (chars[i] == '\n') newlines++;
+        if (state == LEX_OUTSIDE && is_blank(chars[i])) {
+            stream->cut = i + 1;
+            stream->cut_line = stream->line + newlines;
+        }
+    }
+}
+
+// Moves what the last window had past its cut into a new one, fills the
+// rest from the file, and points the scanner at it.
+static void next_window(SourceStream* stream) {
+    ObjSource* old = stream->window;
+    int tail = 0;
+    if (old != NULL) {
+        old->chars[stream->cut] = stream->cut_byte;
+        tail = stream->filled - stream->cut;
+        stream->line = stream->cut_line;
+    }
+
+    // A window with nowhere to cut is all tail. Doubling keeps the cost of
+    // copying it forward linear.
+    int capacity = STREAM_WINDOW_SIZE;
+    if (tail > (INT_MAX - (int)sizeof(ObjSource) - SOURCE_PADDING) / 2) {
+        stream->failed = true;
+        stream->at_eof = true;
+        tail = 0;
+    } else if (tail > capacity / 2) {
+        capacity = tail * 2;
+    }
+
+    // The old window is still rooted through `stream->window` here.
+    ObjSource* window = allocate_source(capacity);
+    if (tail > 0) memcpy(window->chars, old->chars + stream->cut, tail);
+    stream->window = window;
+    stream->filled = tail;
+
+    if (!stream->at_eof) {
+        size_t wanted = (size_t)(capacity - tail);
+        size_t read = fread(window->chars + tail, 1, wanted, stream->file);
+        stream->filled += (int)read;
+        if (read < wanted) {
+            stream->at_eof = true;
+            if (ferror(stream->file)) stream->failed = true;
+        }
+    }
+
+    if (stream->at_eof) {
+        // The rest of the input is all here.
+        memset(window->chars + stream->filled, 0, capacity - stream->filled);
+        stream->cut = stream->filled;
+        stream->cut_line = stream->line;
+    } else {
+        find_cut(stream);
+    }
+
+    stream->cut_byte = window->chars[stream->cut];
+    window->chars[stream->cut] = '\0';
+    init_scanner_at(window->chars, stream->line);
+}
+
+// Scans the next token, moving on to the next window whenever the scanner
+// reaches a cut. A terminator before the cut is a NUL byte in the input,
+// which ends it just as it would a whole source.
+Token stream_token(SourceStream* stream) {
+    if (stream->window == NULL) next_window(stream);
+
+    for (;;) {
+        Token token = scan_token();
+        if (token.type != TOKEN_EOF || stream->at_eof ||
+            token.start != stream->window->chars + stream->cut) {
+            stream->previous_window = stream->token_window;
+            stream->token_window = stream->window;
+            return token;
+        }
+        next_window(stream);
+    }
+}
+
+static bool window_holds(ObjSource* window, const char* chars) {
+    return window != NULL && chars >= window->chars && chars < window->chars + window->length;
+}
+
+// The window a recently returned token's characters are in.
+ObjSource* stream_source_of(SourceStream* stream, const char* chars) {
+    if (window_holds(stream->previous_window, chars)) return stream->previous_window;
+    if (window_holds(stream->token_window, chars)) return stream->token_window;
+    return stream->window;
+}
+
+void mark_source_stream(SourceStream* stream) {
+    mark_object((Obj*)stream->window);
+    mark_object((Obj*)stream->token_window);
+    mark_object((Obj*)stream->previous_window);
+}
@@ -0,0 +1,52 @@
+#ifndef clox_stream_h
+#define clox_stream_h
+
+#include "common.h"
+#include "object.h"
+#include "scanner.h"
+#include <stdio.h>
+
+// Bytes read at a time. A window grows past this only to fit a run of
+// input with nowhere to split it, such as one very long string.
+#ifndef STREAM_WINDOW_SIZE
+#define STREAM_WINDOW_SIZE (64 * 1024)
+#endif
+
+// Bytes of code compiled before a batch is run and thrown away.
+#ifndef STREAM_BATCH_SIZE
+#define STREAM_BATCH_SIZE (64 * 1024)
+#endif
+
+// A script read from a file a window at a time, so input of any size can
+// be compiled in bounded memory. Each window is its own ObjSource, which
+// the string literals in it borrow from, and is collected once nothing
+// refers to it any more.
+typedef struct {
+    FILE* file;
+    // The window being scanned. Its `length` is its capacity.
+    ObjSource* window;
+    // The windows of the last two tokens returned, which the parser may
+    // still be looking at after the stream has moved on.
+    ObjSource* token_window;
+    ObjSource* previous_window;
+    // Bytes of `window` read so far.
+    int filled;
+    // Where the scanner has been told the window ends: just past
+    // whitespace outside any string or comment, so no token straddles it.
+    // The byte there is kept in `cut_byte` while the terminator stands in.
+    int cut;
+    char cut_byte;
+    // The line `window` starts on, and the line at the cut.
+    int line;
+    int cut_line;
+    bool at_eof;
+    // Set if reading failed, or a window would have to grow too large.
+    bool failed;
+} SourceStream;
+
+void init_source_stream(SourceStream* stream, FILE* file);
+Token stream_token(SourceStream* stream);
+ObjSource* stream_source_of(SourceStream* stream, const char* chars);
+void mark_source_stream(SourceStream* stream);
+
+#endif // !clox_stream_h
@@ -6,150 +6,251 @@
 #include <stdio.h>
 #include <string.h>
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+// Tombstones count towards the load, so there is always an empty slot to
+// end a probe.
+#define TABLE_MAX_LOAD 0.875
+
+#define CONTROL_EMPTY   ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+
+// One bit per slot of a group, lowest bit first.
+typedef uint32_t GroupMask;
 
 void init_table(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
-    table->entries = 0;
+    table->control = NULL;
+    table->entries = NULL;
 }
 
 void free_table(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(MEM_TABLES, uint8_t, table->control, table->capacity);
+    FREE_ARRAY(MEM_TABLES, Entry, table->entries, table->capacity);
     init_table(table);
 }
 
-static Entry* find_entry(Entry* entries, int capacity, Value* key) {
-    uint32_t index;
-    switch (key->type) {
-        case VAL_BOOL:
-            if (AS_BOOL(*key) == true) index = 1;
-            else index = capacity - 1;
-            break;
-        case VAL_NIL:
-            index = 0;
-            break;
-        case VAL_NUMBER:
-            index = (int)AS_NUMBER(*key) % capacity;
-            break;
-        case VAL_OBJ:
-            if (IS_STRING(*key)) {
-                index = (AS_STRING(*key))->hash % capacity;
-            }
-            break;
+static uint32_t mix_hash(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static uint32_t hash_value(Value key) {
+    if (IS_STRING(key)) return mix_hash(string_hash(AS_STRING(key)));
+    if (IS_OBJ(key)) return mix_hash((uint64_t)(uintptr_t)AS_OBJ(key));
+    if (IS_BOOL(key)) return AS_BOOL(key) ? 0x9e3779b9u : 0x7f4a7c15u;
+    if (IS_NIL(key)) return 0x85ebca6bu;
+
+    // 0 and -0 are equal keys, so they need the same hash.
+    double number = AS_NUMBER(key);
+    if (number == 0) number = 0;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return mix_hash(bits);
+}
+
+// String keys are interned on the way in, so keys_equal() can compare
+// them by identity. Ropes are flattened first.
+static Value table_key(Value key) {
+    if (IS_ROPE(key)) return OBJ_VAL(intern_string(flatten_rope(AS_ROPE(key))));
+    if (IS_STRING(key)) return OBJ_VAL(intern_string(AS_STRING(key)));
+    return key;
+}
+
+// Same result as values_equal(), without the call for the common case of
+// comparing object keys.
+static inline bool keys_equal(Value a, Value b) {
+#ifdef NAN_BOXING
+    if (!IS_NUMBER(a)) return a == b;
+#endif
+    return values_equal(a, b);
+}
+
+// The low seven bits go in the control byte, the rest pick the first group.
+static uint8_t hash_tag(uint32_t hash) {
+    return (uint8_t)(hash & 0x7f);
+}
+
+static int group_mask(Table* table) {
+    return table->capacity / TABLE_GROUP_SIZE - 1;
+}
+
+static int lowest_slot(GroupMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int slot = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        slot++;
+    }
+    return slot;
+#endif
+}
+
+#ifdef SIMD_SSE2
+static GroupMask match_tag(const uint8_t* group, uint8_t tag) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)tag)));
+}
+
+static GroupMask match_empty(const uint8_t* group) {
+    return match_tag(group, CONTROL_EMPTY);
+}
+
+// Empty and deleted are the only control bytes with the high bit set.
+static GroupMask match_empty_or_deleted(const uint8_t* group) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(control);
+}
+#else
+static GroupMask match_tag(const uint8_t* group, uint8_t tag) {
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        if (group[i] == tag) mask |= (GroupMask)1 << i;
+    }
+    return mask;
+}
+
+static GroupMask match_empty(const uint8_t* group) {
+    return match_tag(group, CONTROL_EMPTY);
+}
+
+static GroupMask match_empty_or_deleted(const uint8_t* group) {
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        if (group[i] & 0x80) mask |= (GroupMask)1 << i;
     }
-    Entry* tombstone = NULL;
-
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            return entry;
+    return mask;
+}
+#endif /* ifdef SIMD_SSE2 */
+
+// Groups are visited in triangular-number steps, which reaches every group
+// when their number is a power of two.
+static int find_key(Table* table, Value key, uint32_t hash) {
+    if (table->count == 0) return -1;
+
+    int mask = group_mask(table);
+    int group = (int)(hash >> 7) & mask;
+    uint8_t tag = hash_tag(hash);
+
+    for (int step = 1;; step++) {
+        const uint8_t* control = &table->control[group * TABLE_GROUP_SIZE];
+        for (GroupMask match = match_tag(control, tag); match != 0; match &= match - 1) {
+            int index = group * TABLE_GROUP_SIZE + lowest_slot(match);
+            if (keys_equal(table->entries[index].key, key)) return index;
         }
+        if (match_empty(control) != 0) return -1;
 
-        index = (index + 1) % capacity;
+        group = (group + step) & mask;
     }
 }
 
-bool table_get(Table* table, Value* key, Value* value) {
-    if (table->count == 0) return false;
+static int find_free_slot(Table* table, uint32_t hash) {
+    int mask = group_mask(table);
+    int group = (int)(hash >> 7) & mask;
+
+    for (int step = 1;; step++) {
+        const uint8_t* control = &table->control[group * TABLE_GROUP_SIZE];
+        GroupMask free_slots = match_empty_or_deleted(control);
+        if (free_slots != 0) return group * TABLE_GROUP_SIZE + lowest_slot(free_slots);
+
+        group = (group + step) & mask;
+    }
+}
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+bool table_get(Table* table, Value key, Value* value) {
+    key = table_key(key);
+    int index = find_key(table, key, hash_value(key));
+    if (index == -1) return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
 static void adjust_capacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+    uint8_t* control = ALLOCATE(MEM_TABLES, uint8_t, capacity);
+    hold_scratch(MEM_TABLES, control, sizeof(uint8_t) * capacity);
+    Entry* entries = ALLOCATE(MEM_TABLES, Entry, capacity);
+    release_scratch();
 
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
-
-        Entry* dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
-    }
-
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    uint8_t* old_control = table->control;
+    Entry* old_entries = table->entries;
+    int old_capacity = table->capacity;
 
+    table->control = control;
     table->entries = entries;
     table->capacity = capacity;
+    table->tombstones = 0;
+    memset(table->control, CONTROL_EMPTY, capacity);
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_control[i] & 0x80) continue;
+
+        Entry* entry = &old_entries[i];
+        uint32_t hash = hash_value(entry->key);
+        int index = find_free_slot(table, hash);
+        table->control[index] = hash_tag(hash);
+        table->entries[index] = *entry;
+    }
+
+    FREE_ARRAY(MEM_TABLES, uint8_t, old_control, old_capacity);
+    FREE_ARRAY(MEM_TABLES, Entry, old_entries, old_capacity);
 }
 
-bool table_set(Table* table, Value* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+bool table_set(Table* table, Value key, Value value) {
+    key = table_key(key);
+    uint32_t hash = hash_value(key);
+    int index = find_key(table, key, hash);
+    if (index != -1) {
+        table->entries[index].value = value;
+        return false;
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && IS_NIL(entry->value)) table->count++;
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+        // Only grow when live entries need it; otherwise rehashing in place
+        // is enough to clear out the tombstones.
+        int capacity = table->capacity;
+        if (capacity == 0) {
+            capacity = TABLE_GROUP_SIZE;
+        } else if (table->count + 1 > capacity * TABLE_MAX_LOAD / 2) {
+            capacity *= 2;
+        }
+        adjust_capacity(table, capacity);
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return is_new_key;
+    index = find_free_slot(table, hash);
+    if (table->control[index] == CONTROL_DELETED) table->tombstones--;
+    table->control[index] = hash_tag(hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+    return true;
 }
 
-bool table_delete(Table* table, Value* key) {
-    if (table->count == 0) return false;
+bool table_delete(Table* table, Value key) {
+    key = table_key(key);
+    int index = find_key(table, key, hash_value(key));
+    if (index == -1) return false;
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
-
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    table->control[index] = CONTROL_DELETED;
+    table->count--;
+    table->tombstones++;
     return true;
 }
 
 void table_add_all(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
+        if (from->control[i] & 0x80) continue;
         Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            table_set(to, entry->key, entry->value);
-        }
-    }
-}
-
-ObjString* table_find_string(Table* table, const char* chars,
-                             int length, uint32_t hash) {
-    if (table->count == 0) return NULL;
-
-    uint32_t index = hash % table->capacity;
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) return NULL;
-        } else switch (entry->key->type) {
-            case VAL_OBJ:
-                if (IS_STRING(*entry->key)) {
-                    ObjString* key = AS_STRING(*entry->key);
-                    if (key->length == length &&
-                        key->hash == hash &&
-                        memcmp(key->chars, chars, length) == 0) {
-                        return key;
-                    }
-                }
-                break;
-            default:
-                printf("table_find_string called for entry that's not a string");
-                break;
-        }
-
-        index = (index + 1) % table->capacity;
+        table_set(to, entry->key, entry->value);
     }
 }
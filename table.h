@@ -3,24 +3,33 @@
 
 #include "value.h"
 #include <stdint.h>
+
+// Slots are probed a group at a time; capacity is always a power-of-two
+// multiple of this.
+#define TABLE_GROUP_SIZE 16
+
 typedef struct {
-    Value* key;
+    Value key;
     Value value;
 } Entry;
 
+// An open-addressing hash table in the style of a Swiss table. Each slot has
+// a control byte alongside the entries: empty, deleted, or the low seven
+// bits of the key's hash. Lookups scan a whole group of control bytes at once
+// and only touch entries whose byte matches.
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
+    uint8_t* control;
     Entry* entries;
 } Table;
 
 void init_table(Table* table);
 void free_table(Table* table);
-bool table_get(Table* table, Value* key, Value* value);
-bool table_set(Table* table, Value* key, Value value);
-bool table_delete(Table* table, Value* key);
+bool table_get(Table* table, Value key, Value* value);
+bool table_set(Table* table, Value key, Value value);
+bool table_delete(Table* table, Value key);
 void table_add_all(Table* from, Table* to);
-ObjString* table_find_string(Table* from, const char* chars,
-                             int length, uint32_t hash);
 
 #endif // !clox_table_h
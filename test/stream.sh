@@ -0,0 +1,65 @@
+#!/bin/sh
+# Checks that --stream prints the same output and errors as running the
+# script whole. The build uses windows and batches small enough that cuts
+# land between most tokens and string literals span several windows.
+#
+#   test/stream.sh            (CC and CFLAGS are honoured)
+
+set -e
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O1}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+$CC $CFLAGS -DSTREAM_WINDOW_SIZE=37 -DSTREAM_BATCH_SIZE=20 -o "$work/clox" *.c -lpthread
+
+# Long lines, blank runs, comments holding quotes and strings holding
+# comment markers, and string literals longer than a window, some of them
+# across lines.
+awk 'BEGIN {
+    for (i = 1; i <= 400; i++) {
+        if (i % 7 == 0) print "// a comment with a \" quote in it " i;
+        if (i % 11 == 0) print "\n\n\t  ";
+        if (i % 5 == 0) {
+            print "print \"" i ": // not a comment, and a string much longer than one window\";";
+        } else if (i % 13 == 0) {
+            print "print \"starts on one line\n  and carries on " i " lines later\" + \"!\";";
+        } else {
+            print "print " i " + " i " * (" i " - 1) / 2;";
+        }
+    }
+}' > "$work/ok.lox"
+cp "$work/ok.lox" "$work/error.lox"
+printf 'print "before";\nprint -"not a number";\nprint "after";\n' >> "$work/error.lox"
+
+# DEBUG_PRINT_CODE disassembles every chunk, and a streamed script is many
+# chunks, so only the script's own output is compared. None of its lines
+# ends in a quote, as a string constant split over lines does.
+program_output() {
+    grep -v -e '^== ' -e '^[0-9][0-9][0-9][0-9] ' -e "'\$" "$1" || true
+}
+
+status=0
+for script in ok error; do
+    set +e
+    "$work/clox" --no-cache "$work/$script.lox" > "$work/whole.out" 2> "$work/whole.err"
+    whole=$?
+    "$work/clox" --no-cache --stream "$work/$script.lox" > "$work/stream.out" 2> "$work/stream.err"
+    streamed=$?
+    set -e
+
+    program_output "$work/whole.out" > "$work/whole.txt"
+    program_output "$work/stream.out" > "$work/stream.txt"
+    if [ "$whole" != "$streamed" ] ||
+       ! cmp -s "$work/whole.txt" "$work/stream.txt" ||
+       ! cmp -s "$work/whole.err" "$work/stream.err"; then
+        echo "FAIL $script.lox: --stream differs (exit $whole vs $streamed)"
+        diff "$work/whole.txt" "$work/stream.txt" | head -5
+        diff "$work/whole.err" "$work/stream.err" | head -5
+        status=1
+    else
+        echo "ok   $script.lox"
+    fi
+done
+exit $status
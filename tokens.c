@@ -0,0 +1,399 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "tokens.h"
+
+#ifdef PARALLEL_SCAN
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif /* ifdef PARALLEL_SCAN */
+
+#ifdef SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+static void free_segment(TokenSegment* segment) {
+    free(segment->tokens);
+    free(segment->messages);
+    memset(segment, 0, sizeof(TokenSegment));
+}
+
+#ifdef PARALLEL_SCAN
+
+// Segments are built with malloc, since pieces are scanned on threads that
+// must not touch the VM heap. The total is reported to memory_stats once
+// the stream is complete.
+static bool push_token(TokenSegment* segment, const char* source, Token* token) {
+    if (segment->count == segment->capacity) {
+        int capacity = GROW_CAPACITY(segment->capacity);
+        PackedToken* tokens = (PackedToken*)realloc(segment->tokens, sizeof(PackedToken) * capacity);
+        if (tokens == NULL) return false;
+        segment->tokens = tokens;
+        segment->capacity = capacity;
+    }
+
+    PackedToken* packed = &segment->tokens[segment->count];
+    if (token->type == TOKEN_ERROR) {
+        if (segment->message_count == segment->message_capacity) {
+            int capacity = GROW_CAPACITY(segment->message_capacity);
+            const char** messages =
+                (const char**)realloc(segment->messages, sizeof(const char*) * capacity);
+            if (messages == NULL) return false;
+            segment->messages = messages;
+            segment->message_capacity = capacity;
+        }
+        segment->messages[segment->message_count] = token->start;
+        packed->start = segment->message_count++;
+    } else {
+        packed->start = (int)(token->start - source);
+    }
+    packed->length = token->length;
+    packed->line = token->line;
+    packed->type = (uint8_t)token->type;
+    segment->count++;
+    return true;
+}
+
+static size_t segment_bytes(TokenSegment* segment) {
+    return sizeof(PackedToken) * segment->capacity +
+           sizeof(const char*) * segment->message_capacity;
+}
+
+// A stretch of the source scanned on its own. Every piece after the first
+// starts just past a newline. Strings are the only tokens that span lines,
+// and comments end at one, so all a piece needs to know to scan exactly the
+// tokens a single pass would is whether a string is open where it begins.
+typedef struct {
+    const char* begin;
+    const char* end;
+    // Whether a string is open at `end`, depending on whether one was
+    // open at `begin`.
+    bool ends_in_string[2];
+    bool starts_in_string;
+    // Newlines in [begin, end).
+    int newlines;
+    bool reached_eof;
+    bool failed;
+    TokenSegment segment;
+} Piece;
+
+// Shared by the threads. Each takes the next unclaimed piece until none
+// are left.
+typedef struct {
+    const char* source;
+    Piece* pieces;
+    int count;
+    atomic_int next;
+} Work;
+
+static int count_newlines(const char* from, const char* to) {
+    int newlines = 0;
+    while (from < to) {
+        const char* newline = memchr(from, '\n', to - from);
+        if (newline == NULL) break;
+        newlines++;
+        from = newline + 1;
+    }
+    return newlines;
+}
+
+// Follows the quotes, comments and newlines of the piece in one pass, once
+// as if a string were open at `begin` and once as if not. That is much
+// cheaper than scanning tokens, so it is done before knowing which is so.
+static void classify_piece(Piece* piece) {
+    LexState from_outside = LEX_OUTSIDE;
+    LexState from_string = LEX_IN_STRING;
+    int newlines = 0;
+    const char* p = piece->begin;
+
+#ifdef SIMD_SSE2
+    // Reading past `end` is fine: the source is followed by padding.
+    for (; p < piece->end; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int newline = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+        int special = newline |
+                      _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'))) |
+                      _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('/')));
+        if (piece->end - p < 16) {
+            int live = (1 << (piece->end - p)) - 1;
+            newline &= live;
+            special &= live;
+        }
+        newlines += __builtin_popcount(newline);
+        while (special != 0) {
+            const char* c = p + __builtin_ctz(special);
+            from_outside = lex_step(from_outside, c);
+            from_string = lex_step(from_string, c);
+            special &= special - 1;
+        }
+    }
+#else
+    for (; p < piece->end; p++) {
+        newlines += *p == '\n';
+        from_outside = lex_step(from_outside, p);
+        from_string = lex_step(from_string, p);
+    }
+#endif /* ifdef SIMD_SSE2 */
+
+    piece->ends_in_string[false] = from_outside == LEX_IN_STRING;
+    piece->ends_in_string[true] = from_string == LEX_IN_STRING;
+    piece->newlines = newlines;
+}
+
+// The last piece runs to the end of the source. The others stop at the
+// first token starting at or after `end`, so a token that straddles the
+// boundary belongs to the piece it starts in.
+static void scan_piece(Piece* piece, const char* source, bool last) {
+    const char* start = piece->begin;
+    if (piece->starts_in_string) {
+        // The string was opened, and scanned, by an earlier piece.
+        const char* quote = memchr(start, '"', piece->end - start);
+        if (quote == NULL) return;
+        start = quote + 1;
+    }
+
+    init_scanner_at(start, 1 + count_newlines(piece->begin, start));
+    for (;;) {
+        // A token that ran to the end of the source, like an unterminated
+        // string, leaves this piece to scan the EOF after it too.
+        const char* position = skip_to_token();
+        if (!last && position >= piece->end && *position != '\0') break;
+
+        Token token = scan_token();
+        if (!push_token(&piece->segment, source, &token)) {
+            piece->failed = true;
+            return;
+        }
+        if (token.type == TOKEN_EOF) {
+            piece->reached_eof = true;
+            return;
+        }
+    }
+}
+
+static void classify_pieces(Work* work) {
+    for (;;) {
+        int index = atomic_fetch_add(&work->next, 1);
+        if (index >= work->count) return;
+        classify_piece(&work->pieces[index]);
+    }
+}
+
+static void scan_pieces(Work* work) {
+    for (;;) {
+        int index = atomic_fetch_add(&work->next, 1);
+        if (index >= work->count) return;
+        scan_piece(&work->pieces[index], work->source, index == work->count - 1);
+    }
+}
+
+// Helper threads, started the first time a source is pretokenized and
+// kept for the rest of the run, so each pass only has to wake them.
+// A pass bumps `generation`; every helper joins in and counts itself
+// out of `busy` when there is nothing left to take.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    bool started;
+    int helpers;
+    int busy;
+    unsigned generation;
+    void (*task)(Work*);
+    Work* work;
+} Pool;
+
+static Pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void* help(void* argument) {
+    (void)argument;
+    // Helpers are all started before the first pass is posted.
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen) pthread_cond_wait(&pool.wake, &pool.lock);
+        seen = pool.generation;
+        void (*task)(Work*) = pool.task;
+        Work* work = pool.work;
+        pthread_mutex_unlock(&pool.lock);
+
+        task(work);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0) pthread_cond_signal(&pool.done);
+    }
+    return NULL;
+}
+
+static void start_pool(int threads) {
+    if (pool.started) return;
+    pool.started = true;
+    for (int i = 1; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, help, NULL) != 0) break;
+        pthread_detach(thread);
+        pool.helpers++;
+    }
+}
+
+// Runs `task` on the pool and this thread, and waits for them all.
+static void run_pieces(Work* work, void (*task)(Work*)) {
+    atomic_store(&work->next, 0);
+    pthread_mutex_lock(&pool.lock);
+    pool.task = task;
+    pool.work = work;
+    pool.busy = pool.helpers;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    task(work);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static int thread_count() {
+#ifdef PRETOKENIZE_THREADS
+    return PRETOKENIZE_THREADS;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores < 1 ? 1 : (int)cores;
+#endif /* ifdef PRETOKENIZE_THREADS */
+}
+
+// Chains the pieces' segments in order, up to the one that hit the end.
+static bool merge_pieces(TokenStream* stream, Piece* pieces, int count) {
+    stream->segments = (TokenSegment*)malloc(sizeof(TokenSegment) * count);
+    if (stream->segments == NULL) return false;
+
+    int lines_before = 0;
+    for (int i = 0; i < count; i++) {
+        if (pieces[i].failed) return false;
+        pieces[i].segment.line_offset = lines_before;
+        lines_before += pieces[i].newlines;
+        stream->segments[stream->segment_count++] = pieces[i].segment;
+        memset(&pieces[i].segment, 0, sizeof(TokenSegment));
+        if (pieces[i].reached_eof) break;
+    }
+    return true;
+}
+
+#endif /* ifdef PARALLEL_SCAN */
+
+// Splits sources of at least PRETOKENIZE_MIN_SIZE bytes into pieces and
+// scans them on all cores. Returns false, leaving the caller to scan on
+// demand, for smaller sources, a single core, or if memory runs out.
+bool pretokenize(TokenStream* stream, const char* source, int length) {
+#ifdef PARALLEL_SCAN
+    int threads = thread_count();
+    if (threads < 2 || length < PRETOKENIZE_MIN_SIZE) return false;
+
+    // A few pieces per thread, so one slow piece doesn't hold up the rest.
+    int count = threads * 4;
+    if (count > length / PRETOKENIZE_PIECE_SIZE) count = length / PRETOKENIZE_PIECE_SIZE;
+    if (count < 2) return false;
+
+    Piece* pieces = (Piece*)calloc(count, sizeof(Piece));
+    if (pieces == NULL) return false;
+
+    // Every piece after the first starts just past a newline.
+    const char* end = source + length;
+    const char* begin = source;
+    int made = 0;
+    while (begin < end) {
+        const char* split = source + (int64_t)length * (made + 1) / count;
+        if (split < begin) split = begin;
+        const char* newline = made == count - 1 ? NULL : memchr(split, '\n', end - split);
+        split = newline == NULL ? end : newline + 1;
+        pieces[made].begin = begin;
+        pieces[made].end = split;
+        made++;
+        begin = split;
+    }
+
+    Work work;
+    work.source = source;
+    work.pieces = pieces;
+    work.count = made;
+    atomic_init(&work.next, 0);
+
+    // Find out where strings are open, which only depends on the pieces
+    // before, then scan them all knowing it.
+    start_pool(threads);
+    run_pieces(&work, classify_pieces);
+    bool in_string = false;
+    for (int i = 0; i < made; i++) {
+        pieces[i].starts_in_string = in_string;
+        in_string = pieces[i].ends_in_string[in_string];
+    }
+    run_pieces(&work, scan_pieces);
+
+    stream->source = source;
+    stream->segments = NULL;
+    stream->segment_count = 0;
+    stream->segment = 0;
+    stream->next = 0;
+    stream->bytes = 0;
+    bool scanned = merge_pieces(stream, pieces, made);
+
+    for (int i = 0; i < made; i++) free_segment(&pieces[i].segment);
+    free(pieces);
+    if (!scanned) {
+        free_token_stream(stream);
+        return false;
+    }
+
+    stream->bytes = sizeof(TokenSegment) * made;
+    for (int i = 0; i < stream->segment_count; i++) {
+        stream->bytes += segment_bytes(&stream->segments[i]);
+    }
+    track_memory(MEM_TOKENS, 0, stream->bytes);
+    return true;
+#else
+    (void)stream;
+    (void)source;
+    (void)length;
+    return false;
+#endif /* ifdef PARALLEL_SCAN */
+}
+
+Token read_token(TokenStream* stream) {
+    while (stream->segment < stream->segment_count) {
+        TokenSegment* segment = &stream->segments[stream->segment];
+        if (stream->next == segment->count) {
+            stream->segment++;
+            stream->next = 0;
+            continue;
+        }
+
+        PackedToken* packed = &segment->tokens[stream->next++];
+        Token token;
+        token.type = (TokenType)packed->type;
+        token.start = packed->type == TOKEN_ERROR ? segment->messages[packed->start]
+                                                  : stream->source + packed->start;
+        token.length = packed->length;
+        token.line = packed->line + segment->line_offset;
+        if (token.type == TOKEN_EOF) stream->eof = token;
+        return token;
+    }
+    return stream->eof;
+}
+
+void free_token_stream(TokenStream* stream) {
+    for (int i = 0; i < stream->segment_count; i++) {
+        free_segment(&stream->segments[i]);
+    }
+    free(stream->segments);
+    track_memory(MEM_TOKENS, stream->bytes, 0);
+    stream->segments = NULL;
+    stream->segment_count = 0;
+    stream->bytes = 0;
+}
@@ -0,0 +1,58 @@
+#ifndef clox_tokens_h
+#define clox_tokens_h
+
+#include "common.h"
+#include "scanner.h"
+#include <stdint.h>
+
+// Sources shorter than this are scanned as the compiler asks for tokens.
+#ifndef PRETOKENIZE_MIN_SIZE
+#define PRETOKENIZE_MIN_SIZE (1024 * 1024)
+#endif
+
+// Pieces are at least this long, so every thread gets a worthwhile share.
+#ifndef PRETOKENIZE_PIECE_SIZE
+#define PRETOKENIZE_PIECE_SIZE (256 * 1024)
+#endif
+
+// A Token with offsets instead of pointers, at two thirds of the size.
+typedef struct {
+    // Offset into the source. For TOKEN_ERROR, an index into the
+    // segment's messages instead.
+    int start;
+    int length;
+    // Counted from 1 at the start of the segment.
+    int line;
+    uint8_t type;
+} PackedToken;
+
+// A run of tokens scanned in one go.
+typedef struct {
+    PackedToken* tokens;
+    int count;
+    int capacity;
+    // Added to every token's line.
+    int line_offset;
+    const char** messages;
+    int message_count;
+    int message_capacity;
+} TokenSegment;
+
+// The tokens of a whole source, consumed in order by read_token().
+typedef struct {
+    const char* source;
+    TokenSegment* segments;
+    int segment_count;
+    int segment;
+    int next;
+    // Returned again once the tokens run out, as scan_token() would.
+    Token eof;
+    // What the segments hold, as reported to memory_stats.
+    size_t bytes;
+} TokenStream;
+
+bool pretokenize(TokenStream* stream, const char* source, int length);
+Token read_token(TokenStream* stream);
+void free_token_stream(TokenStream* stream);
+
+#endif // !clox_tokens_h
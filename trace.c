@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "debug.h"
+#include "memory.h"
+#include "stream.h"
+#include "value.h"
+#include "vm.h"
+
+#define TRACE_MAGIC "CLOXTRC"
+#define TRACE_VERSION 2
+
+TraceBuffer trace_buffer;
+
+// Written at the start of a dump. The records only make sense to a build
+// with the same Value layout, so that is recorded too.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t value_size;
+    uint32_t nan_boxing;
+    // Set when the offsets are into streamed batches rather than one chunk.
+    uint32_t streamed;
+    uint64_t total;
+    uint64_t stored;
+} TraceHeader;
+
+static void init_header(TraceHeader* header) {
+    memset(header, 0, sizeof(TraceHeader));
+    memcpy(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof(TraceRecord);
+    header->value_size = sizeof(Value);
+#ifdef NAN_BOXING
+    header->nan_boxing = 1;
+#endif
+}
+
+// Writes the buffered records to the trace path, oldest first. Does
+// nothing if no path was given.
+bool dump_trace() {
+    if (trace_buffer.path == NULL) return true;
+    FILE* file = fopen(trace_buffer.path, "wb");
+    if (file == NULL) return false;
+
+    TraceHeader header;
+    init_header(&header);
+    header.streamed = trace_buffer.streamed;
+    header.total = trace_buffer.count;
+    header.stored = trace_buffer.count < TRACE_CAPACITY
+        ? trace_buffer.count : TRACE_CAPACITY;
+    fwrite(&header, sizeof(TraceHeader), 1, file);
+
+    uint64_t first = trace_buffer.count - header.stored;
+    for (uint64_t i = first; i < trace_buffer.count; i++) {
+        fwrite(&trace_buffer.records[i & (TRACE_CAPACITY - 1)],
+               sizeof(TraceRecord), 1, file);
+    }
+
+    bool written = !ferror(file);
+    return fclose(file) == 0 && written;
+}
+
+static void print_top(TraceRecord* record) {
+    if (record->depth == 0) {
+        printf("-");
+    } else if (IS_OBJ(record->top)) {
+        // The object is long gone; only its address was recorded.
+        printf("<obj %p>", (void*)AS_OBJ(record->top));
+    } else {
+        print_value(record->top);
+    }
+}
+
+static void print_record(Chunk* chunk, TraceRecord* record, uint64_t index) {
+    printf("%8llu [%4u] ", (unsigned long long)index, record->depth);
+    print_top(record);
+    printf(" | ");
+
+    if (record->offset >= (uint32_t)chunk->count) {
+        printf("offset %u is outside the chunk\n", record->offset);
+        return;
+    }
+    uint8_t original = chunk->code[record->offset];
+    chunk->code[record->offset] = record->instruction;
+    disassemble_instruction(chunk, (int)record->offset);
+    chunk->code[record->offset] = original;
+}
+
+// Compiles the source again in the same batches it was run in. Records are
+// in the order they ran, so only the batch being printed is kept.
+static void decode_batches(FILE* file, ObjSource* source, Chunk* chunk, uint64_t index) {
+    FILE* script = tmpfile();
+    if (script == NULL ||
+        fwrite(source->chars, 1, (size_t)source->length, script) != (size_t)source->length ||
+        fseek(script, 0L, SEEK_SET) != 0) {
+        fprintf(stderr, "Could not stream the script again.\n");
+        if (script != NULL) fclose(script);
+        return;
+    }
+
+    SourceStream stream;
+    init_source_stream(&stream, script);
+    start_streaming(&stream);
+    vm.chunk = chunk;
+
+    uint32_t batch = 0;
+    bool compiled = compile_batch(chunk);
+    TraceRecord record;
+    while (fread(&record, sizeof(TraceRecord), 1, file) == 1) {
+        while (compiled && batch < record.batch && !stream_finished()) {
+            free_chunk(chunk);
+            compiled = compile_batch(chunk);
+            batch++;
+        }
+        if (!compiled || batch != record.batch) {
+            printf("%8llu batch %u could not be compiled again\n",
+                   (unsigned long long)index++, record.batch);
+            continue;
+        }
+        print_record(chunk, &record, index++);
+    }
+
+    vm.chunk = NULL;
+    stop_streaming();
+    fclose(script);
+}
+
+// Prints a dump made while running `source`. The source is compiled again to
+// get the chunk back, in batches if it was streamed, and each record's
+// opcode is patched in before handing the offset to the disassembler, so
+// quickened forms show as they ran.
+bool decode_trace(const char* path, ObjSource* source) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open trace \"%s\".\n", path);
+        return false;
+    }
+
+    TraceHeader expected, header;
+    init_header(&expected);
+    if (fread(&header, sizeof(TraceHeader), 1, file) != 1 ||
+        memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+        header.version != expected.version ||
+        header.record_size != expected.record_size ||
+        header.value_size != expected.value_size ||
+        header.nan_boxing != expected.nan_boxing) {
+        fprintf(stderr, "\"%s\" is not a trace from this build.\n", path);
+        fclose(file);
+        return false;
+    }
+
+    Chunk chunk;
+    init_chunk(&chunk);
+    uint64_t index = header.total - header.stored;
+    if (header.streamed) {
+        printf("== trace: %llu of %llu instructions, streamed ==\n",
+               (unsigned long long)header.stored, (unsigned long long)header.total);
+        decode_batches(file, source, &chunk, index);
+    } else {
+        if (!compile(source, &chunk)) {
+            free_chunk(&chunk);
+            fclose(file);
+            return false;
+        }
+
+        printf("== trace: %llu of %llu instructions ==\n",
+               (unsigned long long)header.stored, (unsigned long long)header.total);
+        TraceRecord record;
+        while (fread(&record, sizeof(TraceRecord), 1, file) == 1) {
+            print_record(&chunk, &record, index++);
+        }
+    }
+
+    free_chunk(&chunk);
+    fclose(file);
+    return true;
+}
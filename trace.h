@@ -0,0 +1,49 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "value.h"
+#include <stdint.h>
+
+// Records kept in memory; older ones are overwritten. Must be a power of two.
+#define TRACE_CAPACITY 65536
+
+// One executed instruction, as seen just before it ran. `top` is only
+// meaningful when `depth` is non-zero. `offset` is into the chunk of
+// batch `batch` when the script was streamed.
+typedef struct {
+    Value top;
+    uint32_t offset;
+    uint32_t depth;
+    uint32_t batch;
+    uint8_t instruction;
+} TraceRecord;
+
+typedef struct {
+    TraceRecord records[TRACE_CAPACITY];
+    // Total recorded so far, including records that have been overwritten.
+    uint64_t count;
+    // Where dumps go, from --trace. Nothing is dumped when NULL.
+    const char* path;
+    // Whether the script is being run in batches, and which one is running.
+    bool streamed;
+    uint32_t batch;
+} TraceBuffer;
+
+extern TraceBuffer trace_buffer;
+
+static inline void trace_record(uint32_t offset, uint8_t instruction,
+                                Value* stack, Value* stack_top) {
+    TraceRecord* record =
+        &trace_buffer.records[trace_buffer.count++ & (TRACE_CAPACITY - 1)];
+    record->offset = offset;
+    record->batch = trace_buffer.batch;
+    record->instruction = instruction;
+    record->depth = (uint32_t)(stack_top - stack);
+    record->top = stack_top > stack ? stack_top[-1] : NIL_VAL;
+}
+
+bool dump_trace();
+bool decode_trace(const char* path, ObjSource* source);
+
+#endif // !clox_trace_h
@@ -13,9 +13,9 @@ void init_value_array(ValueArray* array) {
 
 void write_value_array(ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
-        int old_capacity = array->capacity;
-        array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+        int capacity = GROW_CAPACITY(array->capacity);
+        array->values = GROW_ARRAY(MEM_CONSTANTS, Value, array->values, array->capacity, capacity);
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
@@ -23,29 +23,55 @@ void write_value_array(ValueArray* array, Value value) {
 }
 
 void free_value_array(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(MEM_CONSTANTS, Value, array->values, array->capacity);
     init_value_array(array);
 }
 
 void print_value(Value value) {
-    switch (value.type) {
-        case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
-            break;
-        case VAL_NIL:       printf("nil");                  break;
-        case VAL_NUMBER:    printf("%g", AS_NUMBER(value)); break;
-        case VAL_OBJ:       print_object(value);            break;
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        print_object(value);
     }
 }
 
+// The slow path for two distinct objects. Two interned strings are only
+// equal if they are the same object; otherwise compare the bytes, using
+// hashes to reject early when both have already been computed.
+static bool strings_equal(Value a, Value b) {
+    if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b)) return false;
+    ObjString* x = IS_ROPE(a) ? flatten_rope(AS_ROPE(a)) : AS_STRING(a);
+    ObjString* y = IS_ROPE(b) ? flatten_rope(AS_ROPE(b)) : AS_STRING(b);
+    if (x == y) return true;
+    if (x->is_interned && y->is_interned) return false;
+    if (x->length != y->length) return false;
+    if (x->hash != 0 && y->hash != 0 && x->hash != y->hash) return false;
+    return memcmp(x->chars, y->chars, x->length) == 0;
+}
+
 bool values_equal(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles so that NaN != NaN and 0 == -0.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (a == b) return true;
+    return IS_OBJ(a) && IS_OBJ(b) && strings_equal(a, b);
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:       return true;
         case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            return strings_equal(a, b);
 
         default:            return false;
     }
+#endif /* ifdef NAN_BOXING */
 }
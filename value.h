@@ -2,9 +2,55 @@
 #define clox_value_h
 
 #include "common.h"
+#include <string.h>
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjSource ObjSource;
+
+#ifdef NAN_BOXING
+
+// Numbers are stored as plain doubles. Everything else lives inside the
+// quiet NaN space: singletons use the low tag bits, objects set the sign bit
+// and keep their pointer in the low 48 bits.
+#define SIGN_BIT    ((uint64_t)0x8000000000000000)
+#define QNAN        ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL     1 // 01.
+#define TAG_FALSE   2 // 10.
+#define TAG_TRUE    3 // 11.
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUMBER(value)    value_to_num(value)
+#define AS_OBJ(value)       ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)         ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num)     num_to_value(num)
+#define OBJ_VAL(object)     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+
+static inline double value_to_num(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value num_to_value(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
 
 typedef enum {
     VAL_BOOL,
@@ -36,6 +82,8 @@ typedef struct {
 #define NUMBER_VAL(value)   ((Value) {VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)     ((Value) {VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif /* ifdef NAN_BOXING */
+
 typedef struct {
     int capacity;
     int count;
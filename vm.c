@@ -1,15 +1,20 @@
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "vm.h"
+#include "bytecode.h"
 #include "chunk.h"
 #include "debug.h"
 #include "compiler.h"
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 
 VM vm;
@@ -26,20 +31,33 @@ static void runtime_error(const char* format, ...) {
     fputs("\n", stderr);
 
     size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
+    int line = get_line(vm.chunk, (int)instruction);
     fprintf(stderr, "[line %d] in script\n", line);
     reset_stack();
 }
 
 void init_vm() {
+    vm.stack = NULL;
+    vm.stack_capacity = 0;
     reset_stack();
-    vm.objects = NULL;
-    init_table(&vm.strings);
+    init_intern_set(&vm.strings);
+
+    vm.temp_root_count = 0;
+    vm.next_gc = GC_INITIAL_THRESHOLD;
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+    vm.gray_stack = NULL;
 }
 
 void free_vm() {
-    free_table(&vm.strings);
+    FREE_ARRAY(MEM_STACK, Value, vm.stack, vm.stack_capacity);
+    vm.stack = NULL;
+    vm.stack_capacity = 0;
+    free_intern_set(&vm.strings);
     free_objects();
+    free(vm.gray_stack);
+    vm.gray_stack = NULL;
+    vm.gray_capacity = 0;
 }
 
 void push(Value value) {
@@ -61,119 +79,487 @@ static bool is_falsey(Value value) {
 }
 
 static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
-
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    Value result = concatenate_strings(peek(1), peek(0));
+    vm.stack_top -= 2;
+    push(result);
+}
 
-    ObjString* result = take_string(chars, length);
-    push(OBJ_VAL(result));
+static bool add() {
+    if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+        concatenate();
+    } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+    } else {
+        runtime_error("Operands must be numbers or strings.");
+        return false;
+    }
+    return true;
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() \
+    trace_record((uint32_t)(vm.ip - vm.chunk->code), *vm.ip, vm.stack, vm.stack_top)
+#else
+#define TRACE_EXECUTION() do {} while (false)
+#endif /* ifdef DEBUG_TRACE_EXECUTION */
+
 static InterpretResult run() {
 #define READ_BYTE() (*vm.ip++)
 #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define BINARY_OP(value_type, op) \
+#define READ_CONSTANT_LONG() \
+    (vm.ip += 3, \
+     vm.chunk->constants.values[(vm.ip[-3] << 16) | (vm.ip[-2] << 8) | vm.ip[-1]])
+#define BINARY_OP(value_type, op, quick_op) \
     do { \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
             runtime_error("Operands must be numbers"); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
+        vm.ip[-1] = quick_op; \
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        push(value_type(a op b)); \
+    } while(false)
+// Rewinds to a quickened instruction's opcode byte and turns it back into
+// the generic form, which then runs with the full type checks.
+#define DEOPTIMIZE(generic_op) \
+    do { \
+        *--vm.ip = generic_op; \
+        DISPATCH(); \
+    } while (false)
+#define QUICK_BINARY_OP(value_type, op, generic_op) \
+    do { \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEOPTIMIZE(generic_op); \
         double b = AS_NUMBER(pop()); \
         double a = AS_NUMBER(pop()); \
         push(value_type(a op b)); \
     } while(false)
+#define BINARY_CONST_OP(value_type, op) \
+    do { \
+        Value constant = READ_CONSTANT(); \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(constant)) { \
+            runtime_error("Operands must be numbers"); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double b = AS_NUMBER(constant); \
+        double a = AS_NUMBER(pop()); \
+        push(value_type(a op b)); \
+    } while(false)
+// `a >= b` and `a <= b` are `!(a < b)` and `!(a > b)`, which differ from the
+// plain C operators when an operand is NaN.
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
 
-    for(;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
-          printf("[ ");
-          print_value(*slot);
-          printf(" ]");
+#ifdef THREADED_DISPATCH
+    // One label per opcode; every handler jumps straight to the next one, so
+    // each gets its own indirect branch for the predictor to learn.
+    static void* dispatch_table[OP_COUNT] = {
+        [OP_CONSTANT]   = &&CODE_OP_CONSTANT,
+        [OP_CONSTANT_LONG]  = &&CODE_OP_CONSTANT_LONG,
+        [OP_NIL]        = &&CODE_OP_NIL,
+        [OP_TRUE]       = &&CODE_OP_TRUE,
+        [OP_FALSE]      = &&CODE_OP_FALSE,
+        [OP_EQUAL]      = &&CODE_OP_EQUAL,
+        [OP_GREATER]    = &&CODE_OP_GREATER,
+        [OP_LESS]       = &&CODE_OP_LESS,
+        [OP_NOT_EQUAL]      = &&CODE_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL]  = &&CODE_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL]     = &&CODE_OP_LESS_EQUAL,
+        [OP_ADD]        = &&CODE_OP_ADD,
+        [OP_SUBTRACT]   = &&CODE_OP_SUBTRACT,
+        [OP_MULTIPLY]   = &&CODE_OP_MULTIPLY,
+        [OP_DIVIDE]     = &&CODE_OP_DIVIDE,
+        [OP_ADD_CONST]      = &&CODE_OP_ADD_CONST,
+        [OP_SUBTRACT_CONST] = &&CODE_OP_SUBTRACT_CONST,
+        [OP_MULTIPLY_CONST] = &&CODE_OP_MULTIPLY_CONST,
+        [OP_DIVIDE_CONST]   = &&CODE_OP_DIVIDE_CONST,
+        [OP_NOT]        = &&CODE_OP_NOT,
+        [OP_NEGATE]     = &&CODE_OP_NEGATE,
+        [OP_PRINT]      = &&CODE_OP_PRINT,
+        [OP_RETURN]     = &&CODE_OP_RETURN,
+        [OP_ADD_NUM]         = &&CODE_OP_ADD_NUM,
+        [OP_ADD_STR]         = &&CODE_OP_ADD_STR,
+        [OP_SUBTRACT_NUM]    = &&CODE_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM]    = &&CODE_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM]      = &&CODE_OP_DIVIDE_NUM,
+        [OP_GREATER_NUM]     = &&CODE_OP_GREATER_NUM,
+        [OP_LESS_NUM]        = &&CODE_OP_LESS_NUM,
+        [OP_GREATER_EQUAL_NUM] = &&CODE_OP_GREATER_EQUAL_NUM,
+        [OP_LESS_EQUAL_NUM]  = &&CODE_OP_LESS_EQUAL_NUM,
+    };
+    // With --profile every opcode first goes through PROFILE_INSTRUCTION.
+    // Swapping tables keeps the check out of the unprofiled hot path.
+    static void* profile_table[] = {
+        [0 ... UINT8_MAX] = &&PROFILE_INSTRUCTION,
+    };
+    void** dispatch = profiler.enabled ? profile_table : dispatch_table;
+
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE_CODE(op)   CODE_##op
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        goto *dispatch[READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_EXECUTION(); \
+        if (profiler.enabled) profile_instruction(*vm.ip); \
+        switch (READ_BYTE())
+#define CASE_CODE(op)   case op
+#define DISPATCH()      goto loop
+#endif /* ifdef THREADED_DISPATCH */
+
+    INTERPRET_LOOP
+    {
+#ifdef THREADED_DISPATCH
+        PROFILE_INSTRUCTION:
+                            profile_instruction(vm.ip[-1]);
+                            goto *dispatch_table[vm.ip[-1]];
+#endif /* ifdef THREADED_DISPATCH */
+        CASE_CODE(OP_CONSTANT): {
+                            Value constant = READ_CONSTANT();
+                            push(constant);
+                            DISPATCH();
         }
-        printf("\n");
-        disassemble_instruction(vm.chunk, (int) (vm.ip - vm.chunk->code));
-#endif /* ifdef DEBUG_TRACE_EXECUTION */
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                                Value constant = READ_CONSTANT();
-                                push(constant);
-                                break;
-            }
-            case OP_NIL:        push(NIL_VAL);              break;
-            case OP_TRUE:       push(BOOL_VAL(true));       break;
-            case OP_FALSE:      push(BOOL_VAL(false));      break;
-            case OP_EQUAL: {
-                                Value b = pop();
-                                Value a = pop();
-                                push(BOOL_VAL(values_equal(a, b)));
-                                break;
-            }
-            case OP_GREATER:    BINARY_OP(BOOL_VAL,   >);   break;
-            case OP_LESS:       BINARY_OP(BOOL_VAL,   <);   break;
-            case OP_ADD: {
-                                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                                    concatenate();
-                                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                                    double b = AS_NUMBER(pop());
-                                    double a = AS_NUMBER(pop());
-                                    push(NUMBER_VAL(a + b));
-                                } else {
-                                    runtime_error("Operands must be numbers or strings.");
-                                    return INTERPRET_RUNTIME_ERROR;
-                                }
-                                break;
-            }        
-            case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -);   break;
-            case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *);   break;
-            case OP_DIVIDE:     BINARY_OP(NUMBER_VAL, /);   break;
-            case OP_NOT:
-                                push(BOOL_VAL(is_falsey(pop())));
-                                break;
-            case OP_NEGATE:
-                                if (!IS_NUMBER(peek(0))) {
-                                    runtime_error("Operand must be a number.");
-                                    return INTERPRET_RUNTIME_ERROR;
-                                }
-                                /*(*vm.stack_top).as.number *= -1;*/
-                                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                                break;
-            case OP_PRINT:
-                                print_value(pop());
-                                printf("\n");
-                                break;
-            case OP_RETURN: {
-                                // Exit interpreter
-                                return INTERPRET_OK;
-            }
+        CASE_CODE(OP_CONSTANT_LONG): {
+                            Value constant = READ_CONSTANT_LONG();
+                            push(constant);
+                            DISPATCH();
+        }
+        CASE_CODE(OP_NIL):      push(NIL_VAL);              DISPATCH();
+        CASE_CODE(OP_TRUE):     push(BOOL_VAL(true));       DISPATCH();
+        CASE_CODE(OP_FALSE):    push(BOOL_VAL(false));      DISPATCH();
+        // Comparing ropes flattens them, which can collect, so the
+        // operands stay on the stack until the result is known.
+        CASE_CODE(OP_EQUAL): {
+                            bool equal = values_equal(peek(1), peek(0));
+                            vm.stack_top -= 2;
+                            push(BOOL_VAL(equal));
+                            DISPATCH();
+        }
+        CASE_CODE(OP_GREATER):  BINARY_OP(BOOL_VAL,   >, OP_GREATER_NUM);   DISPATCH();
+        CASE_CODE(OP_LESS):     BINARY_OP(BOOL_VAL,   <, OP_LESS_NUM);      DISPATCH();
+        CASE_CODE(OP_NOT_EQUAL): {
+                            bool equal = values_equal(peek(1), peek(0));
+                            vm.stack_top -= 2;
+                            push(BOOL_VAL(!equal));
+                            DISPATCH();
+        }
+        CASE_CODE(OP_GREATER_EQUAL):
+                            BINARY_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL_NUM);
+                            DISPATCH();
+        CASE_CODE(OP_LESS_EQUAL):
+                            BINARY_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL_NUM);
+                            DISPATCH();
+        CASE_CODE(OP_ADD):
+                            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                                vm.ip[-1] = OP_ADD_NUM;
+                            } else if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+                                vm.ip[-1] = OP_ADD_STR;
+                            }
+                            if (!add()) return INTERPRET_RUNTIME_ERROR;
+                            DISPATCH();
+        CASE_CODE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);  DISPATCH();
+        CASE_CODE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);  DISPATCH();
+        CASE_CODE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);    DISPATCH();
+        CASE_CODE(OP_ADD_CONST):
+                            push(READ_CONSTANT());
+                            if (!add()) return INTERPRET_RUNTIME_ERROR;
+                            DISPATCH();
+        CASE_CODE(OP_SUBTRACT_CONST): BINARY_CONST_OP(NUMBER_VAL, -); DISPATCH();
+        CASE_CODE(OP_MULTIPLY_CONST): BINARY_CONST_OP(NUMBER_VAL, *); DISPATCH();
+        CASE_CODE(OP_DIVIDE_CONST):   BINARY_CONST_OP(NUMBER_VAL, /); DISPATCH();
+        CASE_CODE(OP_NOT):
+                            push(BOOL_VAL(is_falsey(pop())));
+                            DISPATCH();
+        CASE_CODE(OP_NEGATE):
+                            if (!IS_NUMBER(peek(0))) {
+                                runtime_error("Operand must be a number.");
+                                return INTERPRET_RUNTIME_ERROR;
+                            }
+                            /*(*vm.stack_top).as.number *= -1;*/
+                            push(NUMBER_VAL(-AS_NUMBER(pop())));
+                            DISPATCH();
+        CASE_CODE(OP_PRINT):
+                            print_value(peek(0));
+                            pop();
+                            printf("\n");
+                            DISPATCH();
+        CASE_CODE(OP_ADD_NUM):
+                            QUICK_BINARY_OP(NUMBER_VAL, +, OP_ADD);
+                            DISPATCH();
+        CASE_CODE(OP_ADD_STR):
+                            if (!IS_ANY_STRING(peek(0)) || !IS_ANY_STRING(peek(1))) {
+                                DEOPTIMIZE(OP_ADD);
+                            }
+                            concatenate();
+                            DISPATCH();
+        CASE_CODE(OP_SUBTRACT_NUM):
+                            QUICK_BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT);
+                            DISPATCH();
+        CASE_CODE(OP_MULTIPLY_NUM):
+                            QUICK_BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY);
+                            DISPATCH();
+        CASE_CODE(OP_DIVIDE_NUM):
+                            QUICK_BINARY_OP(NUMBER_VAL, /, OP_DIVIDE);
+                            DISPATCH();
+        CASE_CODE(OP_GREATER_NUM):
+                            QUICK_BINARY_OP(BOOL_VAL, >, OP_GREATER);
+                            DISPATCH();
+        CASE_CODE(OP_LESS_NUM):
+                            QUICK_BINARY_OP(BOOL_VAL, <, OP_LESS);
+                            DISPATCH();
+        CASE_CODE(OP_GREATER_EQUAL_NUM):
+                            QUICK_BINARY_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL);
+                            DISPATCH();
+        CASE_CODE(OP_LESS_EQUAL_NUM):
+                            QUICK_BINARY_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL);
+                            DISPATCH();
+        CASE_CODE(OP_RETURN): {
+                            // Exit interpreter
+                            return INTERPRET_OK;
         }
     }
 
+#ifndef THREADED_DISPATCH
+    // Unknown opcode; the switch has nowhere else to go.
+    DISPATCH();
+#endif /* ifndef THREADED_DISPATCH */
+
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
 #undef BINARY_OP
+#undef DEOPTIMIZE
+#undef QUICK_BINARY_OP
+#undef BINARY_CONST_OP
+#undef NOT_BOOL_VAL
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char* source) {
-    Chunk chunk;
-    init_chunk(&chunk);
+// What interpret_job() does: compile `source`, or load `bytecode_path`
+// instead, then run the chunk or write it to `output_path`. Or compile
+// and run `stream` a batch at a time.
+typedef struct {
+    ObjSource* source;
+    const char* bytecode_path;
+    const char* output_path;
+    FILE* stream;
+} Job;
 
-    if (!compile(source, &chunk)) {
-        free_chunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+// Checks a chunk that has just been compiled or loaded. Both print the
+// same here, whether or not the chunk came from the cache.
+static bool check_chunk(Chunk* chunk) {
+#ifdef DEBUG_PRINT_CODE
+    disassemble_chunk(chunk, "code");
+#endif /* ifdef DEBUG_PRINT_CODE */
+    if (memory_stats.enabled) print_chunk_memory(stderr, chunk);
+    if (chunk->stack_size >= 0) return true;
+    fprintf(stderr, "Chunk would underflow the value stack.\n");
+    return false;
+}
+
+static InterpretResult run_chunk(Chunk* chunk) {
+    if (vm.stack_capacity != chunk->stack_size) {
+        vm.stack = GROW_ARRAY(MEM_STACK, Value, vm.stack, vm.stack_capacity, chunk->stack_size);
+        vm.stack_capacity = chunk->stack_size;
     }
+    reset_stack();
 
-    vm.chunk = &chunk;
     vm.ip = vm.chunk->code;
 
     InterpretResult result = run();
+    if (profiler.enabled) end_profile_sample();
+#ifdef DEBUG_TRACE_EXECUTION
+    if (result == INTERPRET_RUNTIME_ERROR && !dump_trace()) {
+        fprintf(stderr, "Could not write execution trace.\n");
+    }
+#endif /* ifdef DEBUG_TRACE_EXECUTION */
+
+    return result;
+}
+
+// Each batch runs before the statements after it are parsed, so neither
+// the script nor its bytecode is ever held whole. A syntax error therefore
+// stops the script partway through instead of before it starts.
+static InterpretResult interpret_stream(FILE* file, Chunk* chunk) {
+    SourceStream stream;
+    init_source_stream(&stream, file);
+    start_streaming(&stream);
+
+#ifdef DEBUG_TRACE_EXECUTION
+    trace_buffer.streamed = true;
+    trace_buffer.batch = 0;
+#endif /* ifdef DEBUG_TRACE_EXECUTION */
+
+    InterpretResult result = INTERPRET_OK;
+    while (result == INTERPRET_OK && !stream_finished()) {
+        vm.chunk = chunk;
+        if (!compile_batch(chunk)) {
+            result = INTERPRET_COMPILE_ERROR;
+        } else if (!check_chunk(chunk)) {
+            result = INTERPRET_COMPILE_ERROR;
+        } else {
+            result = run_chunk(chunk);
+        }
+        free_chunk(chunk);
+        vm.chunk = NULL;
+        vm.ip = NULL;
+#ifdef DEBUG_TRACE_EXECUTION
+        trace_buffer.batch++;
+#endif /* ifdef DEBUG_TRACE_EXECUTION */
+    }
+    stop_streaming();
+
+    if (stream.failed) {
+        fprintf(stderr, "Could not read script.\n");
+        return INTERPRET_IO_ERROR;
+    }
+    return result;
+}
+
+// Fills `chunk` from the bytecode cache when it has a copy of `source`,
+// and otherwise compiles it and stores it there.
+static bool compile_chunk(ObjSource* source, SourceKey key, Chunk* chunk) {
+    if (bytecode_cache.dir == NULL) return compile(source, chunk);
+    if (load_cached_chunk(key, chunk)) return true;
+    if (!compile(source, chunk)) return false;
+    store_cached_chunk(key, chunk);
+    return true;
+}
+
+static InterpretResult interpret_chunk(Job* job, Chunk* chunk) {
+    if (job->stream != NULL) return interpret_stream(job->stream, chunk);
+
+    // Keeps the constants rooted from here on, including while a loaded
+    // chunk's strings are made.
+    vm.chunk = chunk;
+
+    // Taken up front: after a cache hit nothing keeps the source alive.
+    SourceKey key = {0, 0};
+    if (job->source != NULL && (bytecode_cache.dir != NULL || job->output_path != NULL)) {
+        key = source_key(job->source);
+    }
+
+    if (job->bytecode_path != NULL) {
+        if (!load_bytecode(job->bytecode_path, chunk)) {
+            fprintf(stderr, "Could not load bytecode from \"%s\".\n", job->bytecode_path);
+            return INTERPRET_IO_ERROR;
+        }
+    } else if (!compile_chunk(job->source, key, chunk)) {
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    if (!check_chunk(chunk)) return INTERPRET_COMPILE_ERROR;
+
+    if (job->output_path != NULL) {
+        if (!write_bytecode(chunk, key, job->output_path)) {
+            fprintf(stderr, "Could not write bytecode to \"%s\".\n", job->output_path);
+            return INTERPRET_IO_ERROR;
+        }
+        return INTERPRET_OK;
+    }
+
+    return run_chunk(chunk);
+}
+
+// Reports the heap limit, or malloc itself, failing partway through
+// interpret(). Before run() starts, vm.ip is NULL and there is no
+// instruction to blame.
+static void report_heap_limit(int error) {
+    char message[64];
+    if (error == HEAP_LIMIT_EXCEEDED) {
+        snprintf(message, sizeof(message), "Heap limit of %zu bytes exceeded.",
+                 memory_stats.max_heap);
+    } else {
+        snprintf(message, sizeof(message), "Out of memory.");
+    }
+
+    if (vm.ip == NULL) {
+        fprintf(stderr, "%s\n", message);
+        return;
+    }
+    runtime_error("%s", message);
+#ifdef DEBUG_TRACE_EXECUTION
+    if (!dump_trace()) fprintf(stderr, "Could not write execution trace.\n");
+#endif /* ifdef DEBUG_TRACE_EXECUTION */
+}
+
+static InterpretResult interpret_job(Job* job) {
+    Chunk chunk;
+    init_chunk(&chunk);
+    vm.chunk = NULL;
+    vm.ip = NULL;
+
+    // Allocations check the limit before touching anything, so after the
+    // jump the chunk and the heap are still consistent and can be freed.
+    jmp_buf handler;
+    int error = setjmp(handler);
+    if (error != 0) {
+        heap_limit_handler = NULL;
+        vm.temp_root_count = 0;
+        // The stream lived in a frame the jump has left. The tokens scanned
+        // ahead and any scratch buffers held in locals would otherwise
+        // never be freed.
+        stop_streaming();
+        stop_pretokenized();
+        free_held_scratch();
+        report_heap_limit(error);
+        free_chunk(&chunk);
+        vm.chunk = NULL;
+        vm.ip = NULL;
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    heap_limit_handler = &handler;
+    InterpretResult result = interpret_chunk(job, &chunk);
+    heap_limit_handler = NULL;
+
     free_chunk(&chunk);
+    vm.chunk = NULL;
+    vm.ip = NULL;
+    return result;
+}
 
+// Runs a chunk put together by hand rather than compiled, e.g. by a
+// benchmark. The caller computes its stack size first and frees it after.
+InterpretResult run_built_chunk(Chunk* chunk) {
+    vm.chunk = chunk;
+    InterpretResult result = run_chunk(chunk);
+    vm.chunk = NULL;
+    vm.ip = NULL;
     return result;
 }
+
+// Takes a source object so that string literals can borrow its characters.
+InterpretResult interpret_source(ObjSource* source) {
+    Job job = {source, NULL, NULL, NULL};
+    return interpret_job(&job);
+}
+
+// Runs a .loxc file, using its code in place.
+InterpretResult interpret_bytecode(const char* path) {
+    Job job = {NULL, path, NULL, NULL};
+    return interpret_job(&job);
+}
+
+// Reads the script from `file` a window at a time, running it in batches
+// as it is compiled, so memory stays bounded however long the input is.
+InterpretResult interpret_file_stream(FILE* file) {
+    Job job = {NULL, NULL, NULL, file};
+    return interpret_job(&job);
+}
+
+// Compiles `source` into a .loxc file at `path` without running it.
+InterpretResult compile_to_bytecode(ObjSource* source, const char* path) {
+    Job job = {source, NULL, path, NULL};
+    return interpret_job(&job);
+}
+
+InterpretResult interpret(const char* source) {
+    return interpret_source(copy_source(source, (int)strlen(source)));
+}
@@ -2,24 +2,42 @@
 #define clox_vm_h
 
 #include "chunk.h"
-#include "table.h"
+#include "intern.h"
 #include <stdint.h>
+#include <stdio.h>
 
-#define STACK_MAX 256
+// How many objects C code can hold in locals across an allocation.
+#define TEMP_ROOTS_MAX 8
 
 typedef struct {
     Chunk* chunk;
     uint8_t* ip;
-    Value stack[STACK_MAX];
+    // Sized by interpret() to the chunk's stack_size, so push() and pop()
+    // need no bounds checks.
+    Value* stack;
+    int stack_capacity;
     Value* stack_top;
-    Table strings;
-    Obj* objects;
+    // Weak: the collector drops strings nothing else refers to.
+    InternSet strings;
+
+    // Extra roots for objects that only C locals point at, e.g. a constant
+    // the compiler has made but not yet added to the chunk.
+    Value temp_roots[TEMP_ROOTS_MAX];
+    int temp_root_count;
+
+    // Collect once memory_stats.bytes_allocated would pass this.
+    size_t next_gc;
+    int gray_count;
+    int gray_capacity;
+    Obj** gray_stack;
 } VM;
 
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
     INTERPRET_RUNTIME_ERROR,
+    // A .loxc file could not be read or written.
+    INTERPRET_IO_ERROR,
 } InterpretResult;
 
 extern VM vm;
@@ -27,6 +45,11 @@ extern VM vm;
 void init_vm();
 void free_vm();
 InterpretResult interpret(const char* source);
+InterpretResult interpret_source(ObjSource* source);
+InterpretResult interpret_bytecode(const char* path);
+InterpretResult interpret_file_stream(FILE* file);
+InterpretResult compile_to_bytecode(ObjSource* source, const char* path);
+InterpretResult run_built_chunk(Chunk* chunk);
 void push(Value value);
 Value pop();
 